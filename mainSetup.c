@@ -3,6 +3,8 @@
 // 150120047 Sena Ektiricioğlu
 // 150120061 Selin Aydın
 
+#define _GNU_SOURCE // for memrchr
+
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
@@ -12,17 +14,100 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <limits.h>
 #include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <spawn.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 // Flags for file creation that does append or truncate accordingly.
 #define CREATE_FLAGS_TRUNC (O_WRONLY | O_CREAT | O_TRUNC)
 #define CREATE_FLAGS_APPEND (O_WRONLY | O_CREAT | O_APPEND)
 
-#define MAX_LINE 80 /* 80 chars per line, per command, should be enough. */
+#define MAX_LINE 512 /* 80 chars were not enough for search with several keywords and options. */
+
+// A file with a NUL byte in its first block is binary and is not searched.
+#define BINARY_CHECK_SIZE 8192
+
+// Search runs on a pool of threads, each worker has a deque of tasks that starts with this size.
+#define SEARCH_DEQUE_INIT 64
+#define SEARCH_MAX_JOBS 256
+#define DIRENT_BUFFER_SIZE (64 * 1024) // directories are read with getdents64 in blocks of this size
+
+// What a search command does with the files it finds
+#define SEARCH_MODE_SCAN 0 // search them directly
+#define SEARCH_MODE_BUILD_INDEX 1 // add them to the trigram index
+#define SEARCH_MODE_USE_INDEX 2 // only search the files the index gives
+#define SEARCH_MODE_WATCH_INDEX 3 // keep the index up to date with inotify
+#define SEARCH_MODE_UNWATCH_INDEX 4 // stop watching
+#define SEARCH_MODE_SYNC_INDEX 5 // compare them with the index, used by the watcher
+#define SEARCH_MODE_SAVE_CACHE 6 // write the result cache to a file
+#define SEARCH_MODE_LOAD_CACHE 7 // read the result cache from a file
+#define SEARCH_MODE_CLEAR_CACHE 8 // forget every cached result
+
+// Output formats of search: lines for people, or NUL separated fields and JSON lines for tools
+#define SEARCH_FORMAT_TEXT 0
+#define SEARCH_FORMAT_NULL 1
+#define SEARCH_FORMAT_JSON 2
+
+// A worker writes its finished file outputs together when this many bytes or outputs are waiting
+#define RESULT_WRITER_BYTES (256 * 1024)
+#define RESULT_WRITER_PARTS 256
+
+// Number of locked parts of the set of visited files
+#define VISITED_SHARDS 64
+
+// Kinds of compiled ignore patterns
+#define IGNORE_LITERAL 0 // a plain name or path
+#define IGNORE_SUFFIX 1 // * and a plain ending, like *.o
+#define IGNORE_GLOB 2 // anything else
 
-// For paths, we had to limit the path and line lengths so that we can store them in an array.
-#define MAX_PATH_LEN 256
-#define MAX_LINE_LEN 1024
+// io_uring of a search worker: queue size, files read together, and the size above which a file is mapped
+#define URING_ENTRIES 64
+#define URING_BATCH 32
+#define URING_MAX_READ (1024 * 1024)
+
+// Files of at least this size are searched on several threads, each thread takes at least PARALLEL_CHUNK_MIN bytes
+#define PARALLEL_FILE_SIZE (32 * 1024 * 1024)
+#define PARALLEL_CHUNK_MIN (8 * 1024 * 1024)
+
+// The result cache, its memory limit and the file it is saved to
+#define RESULT_CACHE_SHARDS 64
+#define RESULT_CACHE_MAX_BYTES (64 * 1024 * 1024)
+#define RESULT_CACHE_NAME ".myshell_search_cache"
+#define RESULT_CACHE_MAGIC "MYSHRC01"
+
+// Node and NFA state types of search -e, and the size of the DFA cache of each worker
+#define REGEX_SET 0
+#define REGEX_CONCAT 1
+#define REGEX_ALT 2
+#define REGEX_STAR 3
+#define REGEX_PLUS 4
+#define REGEX_QUEST 5
+#define REGEX_BOL 6
+#define REGEX_EOL 7
+#define REGEX_SPLIT 8
+#define REGEX_MATCH 9
+#define DFA_MAX_STATES 1024
+#define DFA_HASH_SIZE 1024
+
+// Name of the trigram index file in the searched directory, and the magic at its beginning
+#define SEARCH_IGNORE_NAME ".gitignore"
+#define SEARCH_INDEX_NAME ".myshell_index"
+#define SEARCH_INDEX_MAGIC "MYSHIDX1"
+#define RESULT_WATCH_MASK (IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DONT_FOLLOW | IN_ONLYDIR)
+#define INDEX_WATCH_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DONT_FOLLOW | IN_ONLYDIR)
 
 // Global variables since we need them for handlers
 pid_t pid;
@@ -30,6 +115,14 @@ int foreground;
 
 int main(void);
 void setupSignalHandler(void);
+void indexFile(int workerId, int dirFd, const char *name, const char *filePath);
+void watchIndexDirectory(const char *dirPath);
+struct IgnoreList;
+int followDirectory(const char *dirPath);
+void setFollowedIgnores(int wd, struct IgnoreList *ignore);
+void rememberFollowedFile(const char *name, off_t size);
+void updateIndexEntry(const char *name);
+int hasSameStamp(const struct stat *fileStat, uint64_t dev, uint64_t ino, int64_t mtimeSec, int64_t mtimeNsec, uint64_t size);
 /* The setup function below will not return any value, but it will just: read
 in the next command line; separate it into distinct arguments (using blanks as
 delimiters), and set the args array entries to point to the beginning of what
@@ -61,6 +154,92 @@ void setupSignalHandler() {
     }
 }
 
+// ***** MEMORY ARENAS *****
+// What a command line needs only while it runs is taken from commandArena by moving a pointer, and
+// the whole arena is reset before the next prompt. Things that stay, like the bookmarks, are copied
+// into their own pool, so the memory of the shell does not grow with the number of commands.
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+// a block of an arena, the allocations are in data one after another
+struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct Arena {
+    struct ArenaBlock *blocks; // the newest block first
+    size_t usedBytes; // bytes given out since the last reset
+    size_t freedBytes; // bytes of them that are not used anymore, a pool is copied when they are most of it
+};
+
+struct Arena commandArena; // reset for every command
+struct Arena bookmarkPool; // the bookmarks, it lives until the shell exits
+
+// This method gives size bytes from the arena, a new block is taken only when the current one is full
+void *arenaAlloc(struct Arena *arena, size_t size){
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    struct ArenaBlock *block = arena->blocks;
+    if (block == NULL || block->size - block->used < size) {
+        size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (struct ArenaBlock*)malloc(sizeof(struct ArenaBlock) + blockSize);
+        if (block == NULL) {
+            fprintf(stderr, "Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        block->size = blockSize;
+        block->used = 0;
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+    void *memory = block->data + block->used;
+    block->used += size;
+    arena->usedBytes += size;
+    return memory;
+}
+
+// This method copies a string into the arena
+char *arenaStrdup(struct Arena *arena, const char *str){
+    size_t len = strlen(str) + 1;
+    return (char*)memcpy(arenaAlloc(arena, len), str, len);
+}
+
+// This method forgets everything taken from the arena, one block is kept so the next command does not call malloc
+void resetArena(struct Arena *arena){
+    struct ArenaBlock *kept = NULL;
+    while (arena->blocks != NULL) {
+        struct ArenaBlock *block = arena->blocks;
+        arena->blocks = block->next;
+        if (kept == NULL && block->size == ARENA_BLOCK_SIZE) {
+            kept = block;
+        }
+        else {
+            free(block); // big blocks of a long line are given back
+        }
+    }
+    if (kept != NULL) {
+        kept->used = 0;
+        kept->next = NULL;
+    }
+    arena->blocks = kept;
+    arena->usedBytes = 0;
+    arena->freedBytes = 0;
+}
+
+// This method frees every block of the arena
+void freeArena(struct Arena *arena){
+    while (arena->blocks != NULL) {
+        struct ArenaBlock *block = arena->blocks;
+        arena->blocks = block->next;
+        free(block);
+    }
+    arena->usedBytes = 0;
+    arena->freedBytes = 0;
+}
+
 // To store the bookmarks we implemented a linked list since the size is unknown.
 struct Bookmark{
     char *name; // it stores a name as "command"
@@ -69,8 +248,8 @@ struct Bookmark{
 
 // This method is to allocate memory and put the data to the struct
 struct Bookmark* createBookmark(const char* name) {
-    struct Bookmark* newBookmark = (struct Bookmark*)malloc(sizeof(struct Bookmark)); // mem allocation done for the size of struvt
-    newBookmark->name = strdup(name); // duplicate the name to the bookmark's naem field
+    struct Bookmark* newBookmark = (struct Bookmark*)arenaAlloc(&bookmarkPool, sizeof(struct Bookmark)); // mem allocation done for the size of struvt
+    newBookmark->name = arenaStrdup(&bookmarkPool, name); // duplicate the name to the bookmark's naem field
     newBookmark->next = NULL; // next will be empty so it will be null
     return newBookmark;
 }
@@ -105,6 +284,20 @@ struct Bookmark *getBookmarkByIndex(struct Bookmark *head, int index) {
     return NULL; // if not found return null
 }
 
+// This method moves the bookmarks to a new pool and frees the old one with the deleted bookmarks in it
+void compactBookmarks(struct Bookmark **head) {
+    struct Arena oldPool = bookmarkPool;
+    bookmarkPool.blocks = NULL;
+    bookmarkPool.usedBytes = 0;
+    bookmarkPool.freedBytes = 0;
+    struct Bookmark *copies = NULL;
+    for (struct Bookmark *current = *head; current != NULL; current = current->next) {
+        insertBookmark(&copies, current->name); // the order stays the same
+    }
+    *head = copies;
+    freeArena(&oldPool);
+}
+
 // This method deletes the bookmark usşng the index
 void deleteBookmark(struct Bookmark **head, int index) {
     // if list is empty, return nothing
@@ -138,9 +331,11 @@ void deleteBookmark(struct Bookmark **head, int index) {
         *head = current->next;
     }
 
-    // free them
-    free(current->name);
-    free(current);
+    // the pool can not free one bookmark, it is copied without the deleted ones when they are most of it
+    bookmarkPool.freedBytes += sizeof(struct Bookmark) + strlen(current->name) + 1;
+    if (bookmarkPool.freedBytes > ARENA_BLOCK_SIZE && bookmarkPool.freedBytes * 2 > bookmarkPool.usedBytes) {
+        compactBookmarks(head);
+    }
 }
 
 // This method lists the bookmarks
@@ -288,247 +483,5434 @@ char** split_paths(const char *str, const char *splitter, int *num_of_paths){
     return paths;
 }
 
+// The directories of PATH with . at the end, split once and kept until PATH changes
+struct PathList {
+    char *value; // the PATH they were split from
+    char **dirs; // every directory only once
+    int numDirs;
+    unsigned long generation; // grows when the directories change, tables built from them keep it
+};
 
+struct PathList shellPath;
 
-int createProcess(char **PATH, int number_of_paths ,char **args, int background){
-        int execv_return_val = 0;
-        pid = fork(); // fork
-
-        if (pid == -1) {
-            fprintf(stderr, "Failed to fork.\n"); 
+// This method splits PATH again if it is not the one the list was made from, it costs one compare otherwise
+void updatePathList(void){
+    const char *value = getenv("PATH");  // get paths
+    if (value == NULL) {
+        value = "";
+    }
+    if (shellPath.value != NULL && !strcmp(value, shellPath.value)) {
+        return;
+    }
+    for (int i = 0; i < shellPath.numDirs; i++) {
+        free(shellPath.dirs[i]);
+    }
+    free(shellPath.dirs);
+    free(shellPath.value);
+    shellPath.value = strdup(value);
+    char *withCurrent = (char*)malloc(strlen(value) + 3);
+    sprintf(withCurrent, "%s:.", value); // add the current directory
+    int number_of_paths = 0;
+    char **paths = split_paths(withCurrent, ":", &number_of_paths); // split made by :
+    free(withCurrent);
+    shellPath.numDirs = 0;
+    for (int i = 0; i < number_of_paths; i++) {
+        int isRepeated = 0; // a second one can not find anything new
+        for (int j = 0; j < shellPath.numDirs && !isRepeated; j++) {
+            isRepeated = !strcmp(paths[i], paths[j]);
         }
-        if (pid == 0){ // child process
-            char *temp_path = (char *)malloc(strlen("/") + strlen(args[0]) + 1); // give the path to the command
-            strcpy(temp_path, "/");
-            strcat(temp_path, args[0]);
+        if (isRepeated) {
+            free(paths[i]);
+        }
+        else {
+            paths[shellPath.numDirs++] = paths[i];
+        }
+    }
+    shellPath.dirs = paths;
+    shellPath.generation++;
+}
 
-            for(int i = 0; i < number_of_paths; i++){
-                strcat(PATH[i], temp_path);
-                args[0] = PATH[i];
-                execv_return_val = execv(PATH[i], args); // execute it
-            }
-        } 
-        else { // parent process
-            if(!background){
-                wait(NULL); // wait for the child process
-            }
+// ***** COMMAND PATH CACHE *****
+// Found paths of commands are kept in a hash table like the hash of other shells, so a command is
+// started with one execv instead of trying every PATH directory. Missing commands are kept too. The
+// table is emptied when the PATH list has a new generation or the modification time of a directory changes,
+// a lookup only checks the directories its command depends on.
+
+#define COMMAND_CACHE_SIZE 256
+
+// a command name and where it was found, path is NULL if it is in no PATH directory
+struct CommandEntry {
+    char *name;
+    char *path;
+    int hits; // times it was started
+    int numDirsSeen; // the PATH directories up to the one it is in, all of them if it is missing
+    struct CommandEntry *next;
+};
+
+// a PATH directory as it was when the table was filled
+struct CommandDir {
+    char *path;
+    dev_t dev;
+    ino_t ino; // . is another directory after the current directory changes
+    struct timespec mtime; // a command added or removed changes it
+    int exists;
+};
+
+struct CommandCache {
+    struct CommandEntry *buckets[COMMAND_CACHE_SIZE];
+    struct CommandDir *dirs;
+    int numDirs;
+    unsigned long generation; // of the PATH list the directories are from
+};
+
+struct CommandCache commandCache;
+
+// FNV-1a hash of a command name
+size_t hashCommandName(const char *name){
+    size_t hash = 14695981039346656037ULL;
+    for (; *name; name++) {
+        hash = (hash ^ (unsigned char)*name) * 1099511628211ULL;
+    }
+    return hash % COMMAND_CACHE_SIZE;
+}
+
+// This method forgets every command, hash -r
+void clearCommandCache(void){
+    for (int b = 0; b < COMMAND_CACHE_SIZE; b++) {
+        while (commandCache.buckets[b] != NULL) {
+            struct CommandEntry *entry = commandCache.buckets[b];
+            commandCache.buckets[b] = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
         }
-    return execv_return_val; // return the execution value
+    }
+}
+
+// This method reads the state of a PATH directory
+void statCommandDir(struct CommandDir *dir){
+    struct stat dirStat;
+    dir->exists = stat(dir->path, &dirStat) == 0;
+    if (dir->exists) {
+        dir->dev = dirStat.st_dev;
+        dir->ino = dirStat.st_ino;
+        dir->mtime = dirStat.st_mtim;
+    }
+}
+
+// This method empties the table if PATH or one of its first numDirs directories changed since it was filled.
+// A command found in a directory can only be hidden by the ones before it, so the later ones are not looked at.
+// Returns 1 if the table is emptied.
+int checkCommandCache(int numDirs){
+    int isChanged = commandCache.generation != shellPath.generation;
+    for (int i = 0; !isChanged && i < numDirs && i < commandCache.numDirs; i++) {
+        struct CommandDir *then = &commandCache.dirs[i];
+        struct CommandDir now = {.path = then->path};
+        statCommandDir(&now);
+        isChanged = now.exists != then->exists || (now.exists && (now.dev != then->dev || now.ino != then->ino
+            || now.mtime.tv_sec != then->mtime.tv_sec || now.mtime.tv_nsec != then->mtime.tv_nsec));
+    }
+    if (!isChanged) {
+        return 0;
+    }
+    clearCommandCache();
+    free(commandCache.dirs);
+    commandCache.dirs = (struct CommandDir*)malloc(shellPath.numDirs * sizeof(struct CommandDir));
+    commandCache.numDirs = shellPath.numDirs;
+    commandCache.generation = shellPath.generation;
+    for (int i = 0; i < shellPath.numDirs; i++) {
+        commandCache.dirs[i].path = shellPath.dirs[i]; // the PATH list owns the strings, a new generation frees them
+        statCommandDir(&commandCache.dirs[i]);
+    }
+    return 1;
 }
 
-int redirection(char **paths, int number_of_paths ,char **args, int background){
-    int fd; // file descriptor
+// This method gives the entry of a command, it looks in the PATH directories only the first time
+struct CommandEntry *findCommand(const char *name, int *isHashed){
+    size_t bucket = hashCommandName(name);
+    struct CommandEntry *entry = commandCache.buckets[bucket];
+    while (entry != NULL && strcmp(entry->name, name) != 0) {
+        entry = entry->next;
+    }
+    if (!checkCommandCache(entry ? entry->numDirsSeen : 0) && entry != NULL) { // a new command checks only the generation
+        *isHashed = 1;
+        return entry;
+    }
+    *isHashed = 0;
+    entry = (struct CommandEntry*)calloc(1, sizeof(struct CommandEntry));
+    entry->name = strdup(name);
     int i = 0;
-    while(args[i] != NULL){ // until we dont have any argument left
-        if(!strcmp(args[i], ">")){ // if args is > 
-            int initSTDOUT = dup(1); // save the initial state of the stdout
-            fd = open(args[i+1],CREATE_FLAGS_TRUNC, 0777); // open th e file descriptor for truncate, w/ 777 permissions
-            if (fd == -1) {
-                fprintf(stderr, "Failed to open file.\n"); // if fails give error
-                return 1;
-            }
-            dup2(fd,STDOUT_FILENO); // swap them
-            if (close(fd) == -1) {
-                fprintf(stderr, "Failed to close the file.\n");  // close the fd
-                return 1;
-            }
-            args[i] = NULL; // make > null
-            createProcess(paths, number_of_paths, args , background); // create the process
-            if (dup2(initSTDOUT, 1) == -1) { // switch to original state
-                fprintf(stderr, "dup2 failed.\n"); 
-            }
-            close(initSTDOUT); // close the original state
-            return 2; // return with 2
+    for (; i < commandCache.numDirs && entry->path == NULL; i++) {
+        struct CommandDir *dir = &commandCache.dirs[i]; // exists is not trusted, the directory may be made since it was read
+        char *path = (char*)malloc(strlen(dir->path) + strlen(name) + 2);
+        sprintf(path, "%s/%s", dir->path, name);
+        struct stat fileStat;
+        if (stat(path, &fileStat) == 0 && S_ISREG(fileStat.st_mode) && access(path, X_OK) == 0) {
+            entry->path = path;
         }
-        else if(!strcmp(args[i], ">>")){  // if args is >> 
-            int initSTDOUT = dup(1); // save the initial state of the stdout
-            fd = open(args[i+1],CREATE_FLAGS_APPEND, 0777); // open th e file descriptor for truncate, w/ 777 permissions
-            if (fd == -1) {
-                fprintf(stderr, "Failed to open file.\n");  // if fails give error
-                return 1;
-            }
-            dup2(fd,STDOUT_FILENO); // swap them
-            if (close(fd) == -1) {
-                fprintf(stderr, "Failed to close the file\n"); //close the fd
-                return 1;
-            }
-            args[i] = NULL; // make >> null
-            createProcess(paths, number_of_paths, args , background); // create the process
-            if (dup2(initSTDOUT, 1) == -1) { // switch to original state
-                fprintf(stderr, "dup2 failed.\n"); 
-            }
-            close(initSTDOUT); // close the original state
-            return 2; // return with 2
+        else {
+            free(path);
         }
-        else if(!strcmp(args[i], "<")){ // if args is <
-            int initSTDIN = dup(0); // save the initial state of the stdin
-            fd = open(args[i+1], O_RDONLY, 0777); // open th e file descriptor for truncate, w/ 777 permissions
-            if (fd == -1) {
-                fprintf(stderr, "Failed to open file.\n"); // if fails give error
-                return 1;
-            }
-            dup2(fd, STDIN_FILENO); // swap them
-            if (close(fd) == -1) {
-                fprintf(stderr, "Failed to close the file.\n"); // close the fd
-                return 1;
-            }
-            args[i] = NULL; // make < null
-            createProcess(paths, number_of_paths, args , background); // create the process
-            if (dup2(initSTDIN, 1) == -1) { // switch to original state
-                fprintf(stderr, "dup2 failed.\n"); 
+    }
+    entry->numDirsSeen = i;
+    entry->next = commandCache.buckets[bucket];
+    commandCache.buckets[bucket] = entry;
+    return entry;
+}
+
+// This method gives the file a command runs, names with a / are not looked up. NULL if it is not found.
+const char *resolveCommand(const char *name){
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+    int isHashed;
+    struct CommandEntry *entry = findCommand(name, &isHashed);
+    if (entry->path != NULL) {
+        entry->hits++;
+    }
+    return entry->path;
+}
+
+// This method is the hash builtin: hash lists the table, hash -r empties it, hash name... adds the commands
+void hashCommands(char **args){
+    if (args[1] == NULL) {
+        checkCommandCache(commandCache.numDirs); // every listed command must still be right
+        int isEmpty = 1;
+        for (int b = 0; b < COMMAND_CACHE_SIZE; b++) {
+            for (struct CommandEntry *entry = commandCache.buckets[b]; entry != NULL; entry = entry->next) {
+                if (entry->path == NULL) { // missing commands are not listed
+                    continue;
+                }
+                if (isEmpty) {
+                    printf("hits\tcommand\n");
+                    isEmpty = 0;
+                }
+                printf("%4d\t%s\n", entry->hits, entry->path);
             }
-            close(initSTDIN); // close the original state 
-            return 2; // return with 2
         }
-        else if(!strcmp(args[i], "2>")){ // if args is 2>
-            int initSTDERR = dup(2); // save the initial state of the stderr 
-            fd = open(args[i+1],CREATE_FLAGS_APPEND, 0777); // open th e file descriptor for truncate, w/ 777 permissions
-            if (fd == -1) {
-                fprintf(stderr, "Failed to open file.\n"); // if fails give error
-                return 1;
-            }
-            dup2(fd,STDOUT_FILENO); // swap them
-            if (close(fd) == -1) {
-                fprintf(stderr, "Failed to close the file.\n");  // close the fd
-                return 1;
+        if (isEmpty) {
+            printf("hash: hash table empty\n");
+        }
+        return;
+    }
+    if (!strcmp(args[1], "-r")) {
+        clearCommandCache();
+        return;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        int isHashed;
+        if (strchr(args[i], '/') == NULL && findCommand(args[i], &isHashed)->path == NULL) {
+            fprintf(stderr, "hash: %s: not found\n", args[i]);
+        }
+    }
+}
+
+// This method tells if a name is a command of the shell itself
+int isShellBuiltin(const char *name){
+    return !strcmp(name, "bookmark") || !strcmp(name, "search") || !strcmp(name, "exit")
+        || !strcmp(name, "hash") || !strcmp(name, "type");
+}
+
+// This method is the type builtin, it tells what each name would run
+void typeCommands(char **args){
+    for (int i = 1; args[i] != NULL; i++) {
+        if (isShellBuiltin(args[i])) {
+            printf("%s is a shell builtin\n", args[i]);
+            continue;
+        }
+        if (strchr(args[i], '/') != NULL) {
+            if (access(args[i], X_OK) == 0) {
+                printf("%s is %s\n", args[i], args[i]);
             }
-            args[i] = NULL;  // make 2> null
-            createProcess(paths, number_of_paths, args , background); // create the process
-            if (dup2(initSTDERR, 1) == -1) { // switch to original state
-                fprintf(stderr, "dup2 failed.\n"); 
+            else {
+                fprintf(stderr, "type: %s: not found\n", args[i]);
             }
-            close(initSTDERR); // close the original state
-            return 2; // return with 2
+            continue;
+        }
+        int isHashed;
+        struct CommandEntry *entry = findCommand(args[i], &isHashed);
+        if (entry->path == NULL) {
+            fprintf(stderr, "type: %s: not found\n", args[i]);
         }
+        else if (isHashed) {
+            printf("%s is hashed (%s)\n", args[i], entry->path);
+        }
+        else {
+            printf("%s is %s\n", args[i], entry->path);
+        }
+    }
+}
 
-        i++;
+// ***** LAUNCHER *****
+// Commands are started with posix_spawn, which does not copy the page tables of the shell like fork,
+// so starting a command takes the same time however big the shell gets. The redirections are given
+// to it as file actions. fork is only used for a child that has to run code of the shell.
+
+#define MAX_REDIRECTS 8
+
+// a file opened by the shell for the command, it becomes target in the child
+struct Redirect {
+    int fd;
+    int target;
+};
+
+// This method puts a child in a process group, -1 keeps it in the group of the shell, 0 makes a new group of it
+void joinProcessGroup(pid_t child, pid_t group){
+    if (group != -1) {
+        setpgid(child, group);
+    }
+}
+
+// This method starts a command with fork and puts the redirections in place in the child
+int forkCommand(const char *commandPath, char **args, const struct Redirect *redirects, int numRedirects, pid_t group){
+    pid = fork(); // fork
+    if (pid == -1) {
+        fprintf(stderr, "Failed to fork.\n");
+        return -1;
+    }
+    joinProcessGroup(pid == 0 ? 0 : pid, group); // both sides, so it is in the group whichever runs first
+    if (pid == 0) { // child process
+        for (int r = 0; r < numRedirects; r++) {
+            dup2(redirects[r].fd, redirects[r].target);
+        }
+        execv(commandPath, args); // execute it
+        fprintf(stderr, "%s: %s\n", args[0], strerror(errno)); // it is not a program the child can run
+        _exit(126);
+    }
+    return 0;
+}
+
+// This method starts a command with posix_spawn in a process group like joinProcessGroup, returns -1 if it could not be started
+int spawnCommand(const char *commandPath, char **args, const struct Redirect *redirects, int numRedirects, pid_t group){
+    extern char **environ;
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    for (int r = 0; r < numRedirects; r++) { // the shell opened the files, the child only moves them
+        posix_spawn_file_actions_adddup2(&actions, redirects[r].fd, redirects[r].target);
+    }
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    if (group != -1) {
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup(&attributes, group);
+    }
+    int error = posix_spawn(&pid, commandPath, &actions, &attributes, args, environ);
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+    if (error == ENOSYS) { // no spawn on this system
+        return forkCommand(commandPath, args, redirects, numRedirects, group);
+    }
+    if (error != 0) {
+        fprintf(stderr, "%s: %s\n", args[0], strerror(error));
+        return -1;
+    }
+    return 0;
+}
+
+int createProcess(char **args, int background, const struct Redirect *redirects, int numRedirects){
+        if (args[0] == NULL) { // only a redirection was given
+            return -1;
+        }
+        const char *commandPath = resolveCommand(args[0]); // found once, then taken from the table
+        if (commandPath == NULL) {
+            fprintf(stderr, "%s: command not found\n", args[0]);
+            return -1;
+        }
+        if (spawnCommand(commandPath, args, redirects, numRedirects, -1) == -1) {
+            return -1;
+        }
+        if(!background){
+            waitpid(pid, NULL, 0); // wait for the child process
+        }
+    return 0;
+}
+
+// This function opens the files of >, >>, < and 2> and ends the arguments of the command before the first one.
+// Returns 0 if it is done, or 1 if a file can not be opened, then nothing stays open.
+int collectRedirects(char **args, struct Redirect *redirects, int *numRedirects){
+    int commandEnd = -1; // the arguments of the command end at the first redirection
+    int result = 0;
+    for (int i = 0; args[i] != NULL && result == 0; i++) { // until we dont have any argument left
+        int flags, target;
+        if(!strcmp(args[i], ">")){ // truncate the file for the stdout
+            flags = CREATE_FLAGS_TRUNC;
+            target = STDOUT_FILENO;
+        }
+        else if(!strcmp(args[i], ">>")){ // append to the file for the stdout
+            flags = CREATE_FLAGS_APPEND;
+            target = STDOUT_FILENO;
+        }
+        else if(!strcmp(args[i], "<")){ // read the stdin from the file
+            flags = O_RDONLY;
+            target = STDIN_FILENO;
+        }
+        else if(!strcmp(args[i], "2>")){ // append the stderr to the file
+            flags = CREATE_FLAGS_APPEND;
+            target = STDERR_FILENO;
+        }
+        else {
+            continue;
+        }
+        if (args[i+1] == NULL) {
+            fprintf(stderr, "Please enter a file after %s.\n", args[i]);
+            result = 1;
+            break;
+        }
+        if (*numRedirects == MAX_REDIRECTS) {
+            fprintf(stderr, "Too many redirections.\n");
+            result = 1;
+            break;
+        }
+        // the shell keeps the file only until the command has it
+        int fd = open(args[i+1], flags | O_CLOEXEC, 0777);
+        if (fd == -1) {
+            fprintf(stderr, "Failed to open file.\n"); // if fails give error
+            result = 1;
+            break;
+        }
+        redirects[*numRedirects].fd = fd;
+        redirects[(*numRedirects)++].target = target;
+        if (commandEnd == -1) {
+            commandEnd = i;
+        }
+        i++; // the file name is not an argument
+    }
+    if (result != 0) {
+        for (int r = 0; r < *numRedirects; r++) {
+            close(redirects[r].fd);
+        }
+        *numRedirects = 0;
+    }
+    else if (commandEnd != -1) {
+        args[commandEnd] = NULL; // the command does not see the redirections
+    }
+    return result;
+}
+
+// This function starts the command with the files of its redirections.
+// Returns 0 if there is no redirection, 1 if a file can not be opened and 2 if the command was started.
+int redirection(char **args, int background){
+    struct Redirect redirects[MAX_REDIRECTS];
+    int numRedirects = 0;
+    if (collectRedirects(args, redirects, &numRedirects) != 0) {
+        return 1;
+    }
+    if (numRedirects == 0) {
+        return 0;
+    }
+    createProcess(args, background, redirects, numRedirects); // create the process
+    for (int r = 0; r < numRedirects; r++) {
+        close(redirects[r].fd);
     }
+    return 2;
 }
 
 
 // This function deletes the quotation mark at beginnig and end
 char* deleteQuotationMark(char *str) {
     size_t len = strlen(str); // gets the length
-    char *newStr = (char *)malloc(len - 2 + 1);  // create a new string
-    if (newStr == NULL) {
-        fprintf(stderr, "Memory allocation failed.\n"); // if fails
-    }
-    strncpy(newStr, str + 1, len - 2); // copy from index 1 to index -1 
+    char *newStr = (char *)arenaAlloc(&commandArena, len - 2 + 1);  // create a new string, it lives until the next command
+    memcpy(newStr, str + 1, len - 2); // copy from index 1 to index -1 
     newStr[len - 2] = '\0'; // make last index null
-    if (str != NULL) {
-        free(str); // free the redundant memory
-    }
     return newStr;
 }
 
-// This method searchs in the file for search implementeation
-int searchInFile(const char *filePath, const char *keyword) {
+// Options of the current search command. Workers only read it, so it is shared without a lock.
+struct SearchOptions{
+    char **keywords; // keywords without the quotation marks
+    int numKeywords;
+    size_t keywordLen; // length of the first keyword, used when there is only one
+    int isRegex; // 1 if -e is given, then the only keyword is the literal every match must have
+    int format; // SEARCH_FORMAT_TEXT, or --null / --json
+    int useCache; // 0 if --no-cache is given
+    int useUring; // 0 if --sync-io is given, then files are read with blocking calls
+    int useIgnoreFiles; // 0 if --no-ignore is given, then .gitignore files and .git are searched too
+    struct IgnoreList *excludes; // the --exclude globs, NULL if there is none
+    int listFiles; // -l, only the names of the matching files are printed
+    int countOnly; // -c, only the number of matching lines of every file is printed
+    long maxMatches; // -m N, the search stops after N matches, 0 if there is no limit
+    off_t maxFileSize; // --max-filesize, bigger files are not searched, 0 if there is no limit
+    int maxDepth; // --max-depth, 1 is only the files of the starting directory, -1 if there is no limit
+    int followSymlinks; // -L, links to files and directories are followed
+    int ignoreCase; // -i, ASCII letters match both cases
+    int watchResults; // -w, after the search new matches are printed as the files change
+    char **roots; // --root paths, the current directory is searched if there is none
+    int numRoots;
+    char *filesFrom; // --files-from, a file of NUL separated paths that are searched without a walk
+    const struct TypeFilter *types; // the file types that are read, the index watcher walks with its own
+    uint64_t specHash; // hash of what is searched, a key of the result cache
+    int recursive; // 1 if -r is given
+    int jobs; // number of worker threads given with -j
+    int mode; // SEARCH_MODE_SCAN, or one of the index modes given with --index
+    char rootDir[PATH_MAX]; // the directory search started from
+    size_t rootLen; // length of rootDir, this part is replaced with . while printing
+};
+struct SearchOptions searchOptions;
+atomic_long searchMatchesLeft; // matches that can still be printed with -m
+atomic_int chunkThreadsLeft; // threads that can still be started for the parts of big files, -j for the whole search
+
+// Output of one file is collected here and printed at once, so lines of different files never mix.
+struct SearchOutput{
+    char *data; // the text collected so far
+    size_t length; // used bytes
+    size_t capacity; // allocated bytes
+};
 
-    // GEt the current directory using getcwd
-    char currentDir[MAX_PATH_LEN];
-    if (getcwd(currentDir, sizeof(currentDir)) == NULL) {
-        fprintf(stderr, "Error getting current directory.\n"); 
-        return EXIT_FAILURE;
+// This method makes sure that the output of a file has room for more bytes
+void reserveOutput(struct SearchOutput *out, size_t extra){
+    if (out->length + extra <= out->capacity) {
+        return;
     }
-    // mem allocation for path name
-    char* newFilePath = (char*)malloc(strlen(filePath) - strlen(currentDir) + 1);
-    // instead of the full path name, we used . for the current directory as in the output given from the pdf
-    strcpy(newFilePath, "."); //
-    int startIndex = strlen(currentDir); 
-    strcpy(newFilePath+1, filePath + startIndex); // copy the other parts, now the new file path is ./xx instead of /home/desktop/...
+    size_t newCapacity = out->capacity ? out->capacity * 2 : 256; // grow the buffer by doubling
+    while (newCapacity < out->length + extra) {
+        newCapacity *= 2;
+    }
+    char *newData = (char*)realloc(out->data, newCapacity);
+    if (newData == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    out->data = newData;
+    out->capacity = newCapacity;
+}
 
-    // we keed if it is found
-    int isFound = 0;
-    FILE *file = fopen(filePath, "r"); // open the file 
-    if (file == NULL) {
-        fprintf(stderr, "Error opening file: %s\n", filePath); // if it fails give error
-        return -1;
+// This method appends bytes to the output of a file
+void appendBytes(struct SearchOutput *out, const char *bytes, size_t length){
+    reserveOutput(out, length);
+    memcpy(out->data + out->length, bytes, length);
+    out->length += length;
+}
+
+// This method appends a line number, it is written by hand because printf is slow for it
+void appendNumber(struct SearchOutput *out, long number){
+    char digits[24];
+    int n = 0;
+    unsigned long value = number < 0 ? -(unsigned long)number : (unsigned long)number;
+    do { // the digits come out from the last one
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    reserveOutput(out, n + 1);
+    if (number < 0) {
+        out->data[out->length++] = '-';
     }
+    while (n > 0) {
+        out->data[out->length++] = digits[--n];
+    }
+}
 
-    char line[MAX_LINE_LEN]; // keep the line
-    int lineNumber = 0; // keep the line number
+// This method appends a string with the escapes JSON needs, without quotation marks
+void appendJsonEscaped(struct SearchOutput *out, const char *text, size_t length){
+    static const char hex[] = "0123456789abcdef";
+    size_t start = 0; // bytes that need no escape are copied together
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        appendBytes(out, text + start, i - start);
+        char escape[6] = {'\\', (char)c, 0, 0, 0, 0};
+        int escapeLength = 2;
+        if (c == '\n') {
+            escape[1] = 'n';
+        }
+        else if (c == '\t') {
+            escape[1] = 't';
+        }
+        else if (c == '\r') {
+            escape[1] = 'r';
+        }
+        else if (c < 0x20) { // other control bytes as \u00XX
+            memcpy(escape + 1, "u00", 3);
+            escape[4] = hex[c >> 4];
+            escape[5] = hex[c & 15];
+            escapeLength = 6;
+        }
+        appendBytes(out, escape, escapeLength);
+        start = i + 1;
+    }
+    appendBytes(out, text + start, length - start);
+}
 
-    while (fgets(line, sizeof(line), file) != NULL) {
-        lineNumber++; // increment the line number and get the new line
+// This method appends a string as a JSON string with its quotation marks
+void appendJsonString(struct SearchOutput *out, const char *text, size_t length){
+    appendBytes(out, "\"", 1);
+    appendJsonEscaped(out, text, length);
+    appendBytes(out, "\"", 1);
+}
 
-        // search the keyword in the line
-        if (strstr(line, keyword) != NULL) {
-            printf("\t%d: %s -> %s", lineNumber, newFilePath, line); // print if it exists
-            if(isFound == 0){
-                isFound = 1; // make found 1
+// The result stage. Outputs of finished files are not written one by one: every worker keeps them in
+// its writer and writes a whole batch with a single writev when enough bytes are waiting.
+struct ResultWriter{
+    struct iovec parts[RESULT_WRITER_PARTS]; // outputs of finished files
+    char *buffers[RESULT_WRITER_PARTS]; // the same buffers, parts may move forward after a short write
+    int numParts;
+    size_t pendingBytes;
+};
+pthread_mutex_t resultOutputLock = PTHREAD_MUTEX_INITIALIZER; // batches of different workers never mix
+
+// This method writes every waiting output with writev and frees them
+void flushResults(struct ResultWriter *writer){
+    if (writer->numParts == 0) {
+        return;
+    }
+    struct iovec *part = writer->parts;
+    int count = writer->numParts;
+    pthread_mutex_lock(&resultOutputLock);
+    while (count > 0) {
+        ssize_t written = writev(STDOUT_FILENO, part, count);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
             }
+            break; // stdout is closed, the results are lost like printf would lose them
+        }
+        while (count > 0 && (size_t)written >= part->iov_len) { // skip the parts that are written
+            written -= part->iov_len;
+            part++;
+            count--;
         }
+        if (count > 0) {
+            part->iov_base = (char*)part->iov_base + written;
+            part->iov_len -= written;
+        }
+    }
+    pthread_mutex_unlock(&resultOutputLock);
+    for (int i = 0; i < writer->numParts; i++) {
+        free(writer->buffers[i]);
     }
-    fclose(file); // close the file
-    return isFound; // return the found information
+    writer->numParts = 0;
+    writer->pendingBytes = 0;
 }
 
-// Search in the directory
-void searchInDirectory(const char *dirPath, const char *keyword, int recursive) {
-    DIR *dir = opendir(dirPath); // open the directory
-    int isFound = 0; // store if it is found
-    if (dir == NULL) { 
-        fprintf(stderr, "Error opening directory: %s\n", dirPath); // if fails give error
+// This method gives the output of a finished file to the writer, the writer frees it later
+void writeResults(struct ResultWriter *writer, struct SearchOutput *out){
+    if (out->length == 0) {
+        free(out->data);
+        out->data = NULL;
         return;
     }
+    if (writer->numParts == RESULT_WRITER_PARTS) {
+        flushResults(writer);
+    }
+    writer->parts[writer->numParts].iov_base = out->data;
+    writer->parts[writer->numParts].iov_len = out->length;
+    writer->buffers[writer->numParts] = out->data;
+    writer->numParts++;
+    writer->pendingBytes += out->length;
+    out->data = NULL;
+    out->length = 0;
+    out->capacity = 0;
+    if (writer->pendingBytes >= RESULT_WRITER_BYTES) {
+        flushResults(writer);
+    }
+}
 
-    struct dirent *entry; // it will save the directory entries
-    while ((entry = readdir(dir)) != NULL) { // until it is not null
-        if (entry->d_type == DT_REG) { // if the type is regular file flag
-            char filePath[MAX_PATH_LEN]; // get the file path
-            snprintf(filePath, sizeof(filePath), "%s/%s", dirPath, entry->d_name); // this makes the storing of file path using the struct dirent's name
+// A pattern of an ignore file or of --exclude. It is compiled once, most patterns are a plain name
+// or *.ext and are matched without the glob matcher.
+struct IgnorePattern{
+    char *glob; // the pattern without !, the leading / and the trailing /
+    size_t globLength;
+    int kind; // IGNORE_LITERAL, IGNORE_SUFFIX or IGNORE_GLOB
+    int isNegated; // !pattern, a matching path is searched again
+    int isDirOnly; // pattern/, only directories match
+    int isAnchored; // it has a /, so it is matched against the path from the ignore file's directory
+};
 
-            // we check gere that the ending extension is .c .C .h or .H
-            const char *ext = strrchr(entry->d_name, '.');
-            if (ext != NULL && (strcmp(ext, ".c") == 0 || strcmp(ext, ".C") == 0 || strcmp(ext, ".h") == 0 || strcmp(ext, ".H") == 0)) {
-                if(searchInFile(filePath, keyword)){ // if it is one of these then we call search function
-                    isFound = 1; // make the found state 1
-                }
+// The patterns of one ignore file. A directory shares the list of its parent, or has its own list
+// that points to the parent's one, so the rules of the deeper files are tried first.
+struct IgnoreList{
+    struct IgnorePattern *patterns;
+    int numPatterns;
+    size_t baseLength; // length of the directory of the ignore file in the relative path, with its /
+    struct IgnoreList *parent; // rules of the directories above
+    atomic_int refs; // directories that use it, and the lists below it
+};
 
-            }
-        }
-        // if it is recursive
-        else if (recursive && entry->d_type == DT_DIR && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) { // check the type if directory and dont have . or ..
-            // then we again get the directory and call the function again to find the subdirectories
-            char subDirPath[MAX_PATH_LEN];
-            snprintf(subDirPath, sizeof(subDirPath), "%s/%s", dirPath, entry->d_name);
-            searchInDirectory(subDirPath, keyword, recursive);
+// Identity of a file, the same file has the same pair under every name
+struct FileId{
+    uint64_t dev;
+    uint64_t ino; // 0 for an empty slot
+};
+
+// The files and directories a search has seen, split into shards with their own locks
+struct VisitedShard{
+    struct FileId *ids; // open addressing table, its size is a power of two
+    size_t capacity;
+    size_t numIds;
+    pthread_mutex_t lock;
+};
+struct VisitedShard visitedFiles[VISITED_SHARDS];
+
+// An open directory of the walk. Its children are opened relative to fd, so the kernel never
+// looks up the whole path again. It is shared by the tasks of its children and closed by the last one.
+struct SearchDir{
+    int fd;
+    atomic_int refs; // tasks that still need fd, and the directory task itself while it reads
+    char *path; // full path, only used for printing
+    size_t pathLength;
+    struct IgnoreList *ignore; // ignore rules of this directory, NULL if there is none
+    int depth; // 0 for the starting directory
+};
+
+// A unit of search work. It is either a directory that is not read yet or a file that is not scanned yet.
+struct SearchTask{
+    struct SearchDir *dir; // the directory it is in, NULL for the first tasks
+    char *name; // name in dir, or the full path when dir is NULL
+    int isDir; // 1 if it is a directory
+};
+
+// Every worker has its own deque. The owner pushes and pops at the bottom, idle workers steal from the top.
+struct WorkDeque{
+    struct SearchTask *tasks; // circular array of tasks
+    long capacity; // size of the array, always a power of two
+    atomic_long top; // index of the oldest task, stealing is done from here
+    atomic_long bottom; // index after the newest task, owner works here. Both change under the lock, thieves may read them without it
+    pthread_mutex_t lock; // protects the deque between the owner and thieves
+};
+
+// An io_uring of a worker. Opens and reads of many files are queued together, so the disk always has
+// work to do while the worker searches the files that are already read.
+struct UringReader{
+    int ringFd; // -1 if this worker searches with blocking reads
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray; // submission queue, shared with the kernel
+    unsigned *cqHead, *cqTail, *cqMask; // completion queue, shared with the kernel
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing, *cqRing; // mapped rings, the same memory if the kernel has IORING_FEAT_SINGLE_MMAP
+    size_t sqRingSize, cqRingSize, sqesSize;
+    unsigned toSubmit; // requests queued since the last io_uring_enter
+};
+
+// A file of a batch read with io_uring
+struct UringFile{
+    struct SearchTask task;
+    char *filePath;
+    int fd; // -1 until the open completes
+    struct stat fileStat;
+    char *buffer; // the content of the file
+    size_t readLength; // bytes read so far
+    int numMatches; // result of the search, -1 for an error
+    int isPending; // an open or read of it is sent and not completed
+    struct SearchOutput out; // printed lines
+    struct SearchOutput record; // lines for the result cache
+};
+
+// The worker pool of a search command.
+struct SearchPool{
+    struct WorkDeque *deques; // one deque per worker
+    int numWorkers; // number of workers
+    atomic_long pending; // tasks that are queued or running, the search ends when it becomes 0
+    atomic_int idleWorkers; // number of workers waiting for work
+    pthread_mutex_t idleLock; // used with idleCond to sleep when there is nothing to steal
+    pthread_cond_t idleCond;
+    struct ResultWriter *writers; // one result writer per worker
+    struct UringReader *readers; // one io_uring per worker
+    atomic_int isFound; // 1 if any file had the keyword
+};
+
+// Argument of a worker thread
+struct WorkerArg{
+    struct SearchPool *pool;
+    int id; // index of the worker's own deque
+};
+
+// This method pushes a task to the bottom of the deque, the array is doubled when it is full
+void pushTask(struct WorkDeque *deque, struct SearchTask task){
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom - deque->top == deque->capacity) { // full, so double the size
+        long newCapacity = deque->capacity * 2;
+        struct SearchTask *newTasks = (struct SearchTask*)malloc(newCapacity * sizeof(struct SearchTask));
+        for (long i = deque->top; i < deque->bottom; i++) { // copy them in the same order
+            newTasks[i & (newCapacity - 1)] = deque->tasks[i & (deque->capacity - 1)];
         }
-        
+        free(deque->tasks);
+        deque->tasks = newTasks;
+        deque->capacity = newCapacity;
     }
-    // close the directory opened
-    closedir(dir);
+    deque->tasks[deque->bottom & (deque->capacity - 1)] = task;
+    deque->bottom++;
+    pthread_mutex_unlock(&deque->lock);
 }
 
-int main(void){
-   char inputBuffer[MAX_LINE]; /*buffer to hold command entered */
-    int background; /* equals 1 if a command is followed by '&' */
-    char *args[MAX_LINE/2 + 1]; /*command line arguments */
-    struct Bookmark* bookmarks = NULL; // bookmarks head
+// This method pops the newest task of the owner, returns 0 if the deque is empty
+int popTask(struct WorkDeque *deque, struct SearchTask *task){
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        deque->bottom--;
+        *task = deque->tasks[deque->bottom & (deque->capacity - 1)];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
 
-    while (1) {
-        printf("myshell: "); // print the my shell
-        fflush(stdout); // make sure that it is printed
-        char *PATH = getenv("PATH");  // get paths
-        strcat(PATH, ":."); // add the current directory
-        background = 0; // background is 0 initally
-        /*setup() calls exit() when Control-D is entered */ 
-        setup(inputBuffer, args, &background, 0); // call setup function
-        if(background == 0) // adjust foreground
-            foreground = 1;
-        if(background == 1)
-            foreground = 0;
+// This method steals the oldest task of another worker, returns 0 if the deque is empty
+int stealTask(struct WorkDeque *deque, struct SearchTask *task){
+    int found = 0;
+    if (atomic_load_explicit(&deque->bottom, memory_order_relaxed) <= atomic_load_explicit(&deque->top, memory_order_relaxed)) { // quick check without the lock, it is checked again below
+        return 0;
+    }
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        *task = deque->tasks[deque->top & (deque->capacity - 1)];
+        deque->top++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
 
+// This method adds new work to the pool and wakes up a sleeping worker if there is one
+void submitTask(struct SearchPool *pool, int workerId, struct SearchDir *dir, char *name, int isDir){
+    struct SearchTask task = {dir, name, isDir};
+    atomic_fetch_add(&pool->pending, 1); // count it before anyone can take it
+    pushTask(&pool->deques[workerId], task);
+    if (atomic_load(&pool->idleWorkers) > 0) {
+        pthread_mutex_lock(&pool->idleLock);
+        pthread_cond_signal(&pool->idleCond);
+        pthread_mutex_unlock(&pool->idleLock);
+    }
+}
 
-        // find the paths
-        int number_of_paths = 0;
-        char splitter = ':'; // split made by :
-        char** paths = split_paths(PATH, &splitter, &number_of_paths); // call the method
+// Substring kernels used by search. They return the first place of the needle in the buffer, or NULL.
+// The vector ones compare the first and the last byte of the needle at 16 or 32 positions at once
+// and only call memcmp for the positions where both of them match.
+const char *findSubstringScalar(const char *buffer, size_t length, const char *needle, size_t needleLen){
+    if (needleLen == 0) {
+        return buffer;
+    }
+    const char *end = buffer + length;
+    const char *p = buffer;
+    while (end - p >= (long)needleLen) {
+        p = (const char*)memchr(p, needle[0], end - p - needleLen + 1); // find the first byte
+        if (p == NULL) {
+            return NULL;
+        }
+        if (memcmp(p + 1, needle + 1, needleLen - 1) == 0) { // verify the rest
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
 
-        setupSignalHandler();
+// Counts the newlines in a buffer, used to find the line number of a hit
+size_t countNewlinesScalar(const char *buffer, size_t length){
+    size_t count = 0;
+    const char *end = buffer + length;
+    while ((buffer = (const char*)memchr(buffer, '\n', end - buffer)) != NULL) {
+        count++;
+        buffer++;
+    }
+    return count;
+}
 
-        // ********bookmark*********
-        if(!strcmp(args[0], "bookmark")){ // if it is a bookmark
+// ASCII lower case of every byte, search -i compares bytes through it
+unsigned char foldTable[256];
+
+// This method fills foldTable
+void initFoldTable(void){
+    for (int c = 0; c < 256; c++) {
+        foldTable[c] = (unsigned char)(c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+    }
+}
+
+// This method compares two byte ranges without looking at the case of ASCII letters
+int equalsFolded(const char *a, const char *b, size_t length){
+    for (size_t i = 0; i < length; i++) {
+        if (foldTable[(unsigned char)a[i]] != foldTable[(unsigned char)b[i]]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Finds the first place of needle in buffer like findSubstringScalar, for search -i
+const char *findSubstringFoldScalar(const char *buffer, size_t length, const char *needle, size_t needleLen){
+    if (needleLen == 0) {
+        return buffer;
+    }
+    unsigned char first = foldTable[(unsigned char)needle[0]];
+    for (size_t i = 0; i + needleLen <= length; i++) {
+        if (foldTable[(unsigned char)buffer[i]] == first && equalsFolded(buffer + i + 1, needle + 1, needleLen - 1)) {
+            return buffer + i;
+        }
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+const char *findSubstringSse2(const char *buffer, size_t length, const char *needle, size_t needleLen){
+    if (needleLen == 0 || length < needleLen) {
+        return needleLen == 0 ? buffer : NULL;
+    }
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needleLen - 1]);
+    size_t i = 0;
+    for (; i + needleLen - 1 + 16 <= length; i += 16) {
+        __m128i blockFirst = _mm_loadu_si128((const __m128i*)(buffer + i));
+        __m128i blockLast = _mm_loadu_si128((const __m128i*)(buffer + i + needleLen - 1));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(blockFirst, first), _mm_cmpeq_epi8(blockLast, last)));
+        while (mask != 0) { // every set bit is a candidate
+            int bit = __builtin_ctz(mask);
+            if (memcmp(buffer + i + bit + 1, needle + 1, needleLen - 1) == 0) {
+                return buffer + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return findSubstringScalar(buffer + i, length - i, needle, needleLen); // the tail is shorter than a block
+}
+
+__attribute__((target("sse2")))
+size_t countNewlinesSse2(const char *buffer, size_t length){
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t count = 0, i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(buffer + i));
+        count += __builtin_popcount((unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
+    }
+    return count + countNewlinesScalar(buffer + i, length - i);
+}
+
+// The vector kernels of search -i compare (byte | bit) with the lower case byte, where bit is 0x20 for
+// a letter and 0 for anything else. Setting 0x20 only joins a letter with its other case,
+// so the first and last bytes are compared without any case copy of the buffer.
+__attribute__((target("sse2")))
+const char *findSubstringFoldSse2(const char *buffer, size_t length, const char *needle, size_t needleLen){
+    if (needleLen == 0 || length < needleLen) {
+        return needleLen == 0 ? buffer : NULL;
+    }
+    unsigned char firstByte = foldTable[(unsigned char)needle[0]], lastByte = foldTable[(unsigned char)needle[needleLen - 1]];
+    const __m128i first = _mm_set1_epi8((char)firstByte);
+    const __m128i last = _mm_set1_epi8((char)lastByte);
+    const __m128i firstBit = _mm_set1_epi8(firstByte >= 'a' && firstByte <= 'z' ? 0x20 : 0);
+    const __m128i lastBit = _mm_set1_epi8(lastByte >= 'a' && lastByte <= 'z' ? 0x20 : 0);
+    size_t i = 0;
+    for (; i + needleLen - 1 + 16 <= length; i += 16) {
+        __m128i blockFirst = _mm_or_si128(_mm_loadu_si128((const __m128i*)(buffer + i)), firstBit);
+        __m128i blockLast = _mm_or_si128(_mm_loadu_si128((const __m128i*)(buffer + i + needleLen - 1)), lastBit);
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(blockFirst, first), _mm_cmpeq_epi8(blockLast, last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (equalsFolded(buffer + i + bit + 1, needle + 1, needleLen - 1)) {
+                return buffer + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return findSubstringFoldScalar(buffer + i, length - i, needle, needleLen);
+}
+
+__attribute__((target("avx2")))
+const char *findSubstringAvx2(const char *buffer, size_t length, const char *needle, size_t needleLen){
+    if (needleLen == 0 || length < needleLen) {
+        return needleLen == 0 ? buffer : NULL;
+    }
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needleLen - 1]);
+    size_t i = 0;
+    for (; i + needleLen - 1 + 32 <= length; i += 32) {
+        __m256i blockFirst = _mm256_loadu_si256((const __m256i*)(buffer + i));
+        __m256i blockLast = _mm256_loadu_si256((const __m256i*)(buffer + i + needleLen - 1));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(blockFirst, first), _mm256_cmpeq_epi8(blockLast, last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(buffer + i + bit + 1, needle + 1, needleLen - 1) == 0) {
+                return buffer + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return findSubstringSse2(buffer + i, length - i, needle, needleLen);
+}
+
+__attribute__((target("avx2")))
+size_t countNewlinesAvx2(const char *buffer, size_t length){
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t count = 0, i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(buffer + i));
+        count += __builtin_popcount((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline)));
+    }
+    return count + countNewlinesSse2(buffer + i, length - i);
+}
+
+__attribute__((target("avx2")))
+const char *findSubstringFoldAvx2(const char *buffer, size_t length, const char *needle, size_t needleLen){
+    if (needleLen == 0 || length < needleLen) {
+        return needleLen == 0 ? buffer : NULL;
+    }
+    unsigned char firstByte = foldTable[(unsigned char)needle[0]], lastByte = foldTable[(unsigned char)needle[needleLen - 1]];
+    const __m256i first = _mm256_set1_epi8((char)firstByte);
+    const __m256i last = _mm256_set1_epi8((char)lastByte);
+    const __m256i firstBit = _mm256_set1_epi8(firstByte >= 'a' && firstByte <= 'z' ? 0x20 : 0);
+    const __m256i lastBit = _mm256_set1_epi8(lastByte >= 'a' && lastByte <= 'z' ? 0x20 : 0);
+    size_t i = 0;
+    for (; i + needleLen - 1 + 32 <= length; i += 32) {
+        __m256i blockFirst = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(buffer + i)), firstBit);
+        __m256i blockLast = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(buffer + i + needleLen - 1)), lastBit);
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(blockFirst, first), _mm256_cmpeq_epi8(blockLast, last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (equalsFolded(buffer + i + bit + 1, needle + 1, needleLen - 1)) {
+                return buffer + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return findSubstringFoldSse2(buffer + i, length - i, needle, needleLen);
+}
+#endif
+
+// The kernels picked for this cpu by selectSearchKernels
+const char *(*findSubstring)(const char *, size_t, const char *, size_t) = findSubstringScalar;
+const char *(*findSubstringFold)(const char *, size_t, const char *, size_t) = findSubstringFoldScalar;
+size_t (*countNewlines)(const char *, size_t) = countNewlinesScalar;
+
+// This method picks the fastest kernels the cpu supports, it is called once before the first search
+void selectSearchKernels(void){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        findSubstring = findSubstringAvx2;
+        findSubstringFold = findSubstringFoldAvx2;
+        countNewlines = countNewlinesAvx2;
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        findSubstring = findSubstringSse2;
+        findSubstringFold = findSubstringFoldSse2;
+        countNewlines = countNewlinesSse2;
+    }
+#endif
+}
+
+// Aho-Corasick automaton used when search is given more than one keyword. All keywords are
+// found in one pass over the file. Bytes that appear in no keyword share one class, so every state
+// has only numClasses transitions and the whole table is a single flat array.
+struct AhoCorasick{
+    int32_t *next; // next[state * numClasses + class] is the state after reading a byte of that class
+    int32_t *match; // the keyword that ends at a state (also through its fail links), -1 if none
+    unsigned char classOf[256]; // class of every byte
+    int numClasses;
+    int numStates;
+};
+struct AhoCorasick searchAutomaton;
+
+// This method frees the automaton of the last search
+void freeAutomaton(struct AhoCorasick *automaton){
+    free(automaton->next);
+    free(automaton->match);
+    automaton->next = NULL;
+    automaton->match = NULL;
+    automaton->numStates = 0;
+}
+
+// This method builds the automaton of the keywords. First a trie is built,
+// then the fail links are found in breadth first order and the missing transitions are filled with them.
+void buildAutomaton(struct AhoCorasick *automaton, char **keywords, int numKeywords){
+    // byte classes, class 0 is for the bytes no keyword has. With -i both cases of a letter share a class.
+    memset(automaton->classOf, 0, sizeof(automaton->classOf));
+    automaton->numClasses = 1;
+    size_t maxStates = 1;
+    for (int k = 0; k < numKeywords; k++) {
+        for (const unsigned char *p = (const unsigned char*)keywords[k]; *p; p++) {
+            unsigned char c = searchOptions.ignoreCase ? foldTable[*p] : *p;
+            if (automaton->classOf[c] == 0) {
+                automaton->classOf[c] = (unsigned char)automaton->numClasses++;
+            }
+        }
+        maxStates += strlen(keywords[k]);
+    }
+    if (searchOptions.ignoreCase) {
+        for (int c = 'A'; c <= 'Z'; c++) {
+            automaton->classOf[c] = automaton->classOf[c + ('a' - 'A')];
+        }
+    }
+    int numClasses = automaton->numClasses;
+    automaton->next = (int32_t*)malloc(maxStates * numClasses * sizeof(int32_t));
+    automaton->match = (int32_t*)malloc(maxStates * sizeof(int32_t));
+    memset(automaton->next, -1, maxStates * numClasses * sizeof(int32_t)); // -1 means no transition yet
+    automaton->match[0] = -1;
+    automaton->numStates = 1;
+
+    for (int k = 0; k < numKeywords; k++) { // the trie
+        int state = 0;
+        for (const unsigned char *p = (const unsigned char*)keywords[k]; *p; p++) {
+            int32_t *slot = &automaton->next[state * numClasses + automaton->classOf[*p]];
+            if (*slot == -1) {
+                automaton->match[automaton->numStates] = -1;
+                *slot = automaton->numStates++;
+            }
+            state = *slot;
+        }
+        if (automaton->match[state] == -1) { // the first of equal keywords is reported
+            automaton->match[state] = k;
+        }
+    }
+
+    int32_t *fail = (int32_t*)malloc(automaton->numStates * sizeof(int32_t));
+    int32_t *queue = (int32_t*)malloc(automaton->numStates * sizeof(int32_t));
+    int head = 0, tail = 0;
+    fail[0] = 0;
+    for (int c = 0; c < numClasses; c++) { // children of the root fail to the root
+        int32_t child = automaton->next[c];
+        if (child == -1) {
+            automaton->next[c] = 0;
+        }
+        else {
+            fail[child] = 0;
+            queue[tail++] = child;
+        }
+    }
+    while (head < tail) {
+        int state = queue[head++];
+        if (automaton->match[state] == -1) { // a shorter keyword may end here
+            automaton->match[state] = automaton->match[fail[state]];
+        }
+        for (int c = 0; c < numClasses; c++) {
+            int32_t *slot = &automaton->next[state * numClasses + c];
+            int32_t fallback = automaton->next[fail[state] * numClasses + c];
+            if (*slot == -1) {
+                *slot = fallback; // the parent's fail state already has all of its transitions
+            }
+            else {
+                fail[*slot] = fallback;
+                queue[tail++] = *slot;
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+}
+
+// This method runs the automaton from the beginning of the buffer and returns where the first keyword
+// starts, or NULL. The number of the keyword is written to keywordId.
+const char *findAutomatonMatch(const struct AhoCorasick *automaton, const char *buffer, size_t length, int *keywordId){
+    const int32_t *next = automaton->next;
+    const int32_t *match = automaton->match;
+    const unsigned char *classOf = automaton->classOf;
+    int numClasses = automaton->numClasses;
+    int32_t state = 0;
+    for (size_t i = 0; i < length; i++) {
+        state = next[state * numClasses + classOf[(unsigned char)buffer[i]]];
+        if (match[state] >= 0) {
+            *keywordId = match[state];
+            return buffer + i + 1 - strlen(searchOptions.keywords[match[state]]);
+        }
+    }
+    return NULL;
+}
+
+// This method finds the first place one of the keywords starts in the buffer, or NULL
+const char *findKeyword(const char *buffer, size_t length, int *keywordId){
+    if (searchOptions.numKeywords == 1) { // a single keyword uses the vector kernel
+        *keywordId = 0;
+        if (searchOptions.ignoreCase) {
+            return findSubstringFold(buffer, length, searchOptions.keywords[0], searchOptions.keywordLen);
+        }
+        return findSubstring(buffer, length, searchOptions.keywords[0], searchOptions.keywordLen);
+    }
+    return findAutomatonMatch(&searchAutomaton, buffer, length, keywordId);
+}
+
+
+// ***** REGEX *****
+// search -e "regex" compiles the expression to an NFA once. Every worker then turns it into a DFA
+// lazily, a DFA state is made only when a line reaches it, and its transitions are cached in a flat
+// table. So every byte of a line costs one table lookup after the first few lines, and matching stays
+// linear. Supported: literals, . [] [^] \d \w \s and escapes, * + ? |, groups, ^ and $.
+
+// Node of the parsed expression
+struct RegexNode{
+    int type; // one of the REGEX_ defines
+    unsigned char set[32]; // bytes a REGEX_SET node accepts
+    struct RegexNode **children; // parts of a concatenation, or the two sides of |, or the repeated node
+    int numChildren;
+};
+
+// NFA state, next is where it goes after accepting a byte or after a free move
+struct NfaState{
+    int type; // REGEX_SET, REGEX_SPLIT, REGEX_BOL, REGEX_EOL or REGEX_MATCH
+    unsigned char set[32];
+    int next;
+    int next1; // second way of a split
+};
+
+// The compiled expression, shared by all workers
+struct Regex{
+    struct NfaState *states;
+    int numStates;
+    int capacity;
+    int start;
+    char literal[MAX_LINE]; // a string every matching line must have, may be empty
+    char *pattern; // the expression as it was given
+};
+struct Regex searchRegex;
+
+// A state of the lazy DFA is the set of NFA states the input may be in
+struct DfaState{
+    int *set; // sorted NFA states
+    int setSize;
+    int isMatch; // the line matches as soon as this state is reached
+    int isEolMatch; // the line matches if it ends in this state
+    int hashNext; // next state in the same bucket
+    unsigned int hash;
+};
+
+// The lazy DFA of one worker, so the workers never wait for each other
+struct LazyDfa{
+    struct DfaState *states;
+    int numStates;
+    int32_t *transitions; // transitions[state * 256 + byte], -1 if not computed yet
+    int buckets[DFA_HASH_SIZE]; // first state of every bucket, -1 if empty
+    int *mark; // used to add every NFA state once
+    int generation;
+    int *scratch; // NFA states while a new set is made
+    int startState;
+    int numFlushes; // how many times the cache was full
+    struct LazyDfa *nextDfa; // all of them are in a list so they are freed after the search
+};
+__thread struct LazyDfa *threadDfa; // the DFA of the current worker
+struct LazyDfa *allDfas;
+pthread_mutex_t dfaListLock = PTHREAD_MUTEX_INITIALIZER;
+
+// ---- parser ----
+
+struct RegexNode *newRegexNode(int type){
+    struct RegexNode *node = (struct RegexNode*)calloc(1, sizeof(struct RegexNode));
+    node->type = type;
+    return node;
+}
+
+void addRegexChild(struct RegexNode *node, struct RegexNode *child){
+    node->children = (struct RegexNode**)realloc(node->children, (node->numChildren + 1) * sizeof(struct RegexNode*));
+    node->children[node->numChildren++] = child;
+}
+
+void freeRegexNode(struct RegexNode *node){
+    for (int i = 0; i < node->numChildren; i++) {
+        freeRegexNode(node->children[i]);
+    }
+    free(node->children);
+    free(node);
+}
+
+void addByteToSet(unsigned char *set, unsigned char c){
+    set[c >> 3] |= 1 << (c & 7);
+}
+
+int setHasByte(const unsigned char *set, unsigned char c){
+    return set[c >> 3] & (1 << (c & 7));
+}
+
+// This method adds the bytes of a \d \w \s class to a set, returns 0 if the letter is not a class
+int addEscapeClass(unsigned char *set, char letter){
+    for (int c = 0; c < 256; c++) {
+        if ((letter == 'd' && c >= '0' && c <= '9')
+            || (letter == 'w' && (c == '_' || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')))
+            || (letter == 's' && (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v'))) {
+            addByteToSet(set, (unsigned char)c);
+        }
+    }
+    return letter == 'd' || letter == 'w' || letter == 's';
+}
+
+struct RegexNode *parseRegexAlternation(const char **p);
+
+// atom: ( alternation ) | [ class ] | . | ^ | $ | \escape | byte
+struct RegexNode *parseRegexAtom(const char **p){
+    char c = **p;
+    if (c == '(') {
+        (*p)++;
+        struct RegexNode *inside = parseRegexAlternation(p);
+        if (inside == NULL || **p != ')') {
+            if (inside != NULL) {
+                freeRegexNode(inside);
+            }
+            return NULL;
+        }
+        (*p)++;
+        return inside;
+    }
+    if (c == '^' || c == '$') {
+        (*p)++;
+        return newRegexNode(c == '^' ? REGEX_BOL : REGEX_EOL);
+    }
+    struct RegexNode *node = newRegexNode(REGEX_SET);
+    if (c == '.') {
+        memset(node->set, 0xFF, sizeof(node->set));
+        (*p)++;
+    }
+    else if (c == '[') {
+        (*p)++;
+        int isNegated = 0;
+        if (**p == '^') {
+            isNegated = 1;
+            (*p)++;
+        }
+        int isFirst = 1;
+        while (**p != '\0' && (**p != ']' || isFirst)) { // a ] right after [ is a normal byte
+            unsigned char low = (unsigned char)**p;
+            if (low == '\\' && (*p)[1] != '\0') {
+                (*p)++;
+                if (addEscapeClass(node->set, **p)) {
+                    (*p)++;
+                    isFirst = 0;
+                    continue;
+                }
+                low = (unsigned char)**p;
+            }
+            (*p)++;
+            unsigned char high = low;
+            if (**p == '-' && (*p)[1] != ']' && (*p)[1] != '\0') { // a range like a-z
+                high = (unsigned char)(*p)[1];
+                *p += 2;
+            }
+            for (int b = low; b <= high; b++) {
+                addByteToSet(node->set, (unsigned char)b);
+            }
+            isFirst = 0;
+        }
+        if (**p != ']') {
+            freeRegexNode(node);
+            return NULL;
+        }
+        (*p)++;
+        if (isNegated) {
+            for (int i = 0; i < 32; i++) {
+                node->set[i] = ~node->set[i];
+            }
+        }
+    }
+    else if (c == '\\') {
+        (*p)++;
+        if (**p == '\0') {
+            freeRegexNode(node);
+            return NULL;
+        }
+        if (!addEscapeClass(node->set, **p)) {
+            char escaped = **p;
+            if (escaped == 't') {
+                escaped = '\t';
+            }
+            addByteToSet(node->set, (unsigned char)escaped);
+        }
+        (*p)++;
+    }
+    else if (c == '\0' || c == ')' || c == '|' || c == '*' || c == '+' || c == '?') {
+        freeRegexNode(node);
+        return NULL;
+    }
+    else {
+        addByteToSet(node->set, (unsigned char)c);
+        (*p)++;
+    }
+    return node;
+}
+
+// repeat: atom followed by any number of * + ?
+struct RegexNode *parseRegexRepeat(const char **p){
+    struct RegexNode *node = parseRegexAtom(p);
+    while (node != NULL && (**p == '*' || **p == '+' || **p == '?')) {
+        struct RegexNode *repeat = newRegexNode(**p == '*' ? REGEX_STAR : (**p == '+' ? REGEX_PLUS : REGEX_QUEST));
+        addRegexChild(repeat, node);
+        node = repeat;
+        (*p)++;
+    }
+    return node;
+}
+
+// concatenation: repeats one after another, it may be empty
+struct RegexNode *parseRegexConcat(const char **p){
+    struct RegexNode *concat = newRegexNode(REGEX_CONCAT);
+    while (**p != '\0' && **p != '|' && **p != ')') {
+        struct RegexNode *child = parseRegexRepeat(p);
+        if (child == NULL) {
+            freeRegexNode(concat);
+            return NULL;
+        }
+        addRegexChild(concat, child);
+    }
+    return concat;
+}
+
+// alternation: concatenations separated by |
+struct RegexNode *parseRegexAlternation(const char **p){
+    struct RegexNode *node = parseRegexConcat(p);
+    while (node != NULL && **p == '|') {
+        (*p)++;
+        struct RegexNode *right = parseRegexConcat(p);
+        if (right == NULL) {
+            freeRegexNode(node);
+            return NULL;
+        }
+        struct RegexNode *alternation = newRegexNode(REGEX_ALT);
+        addRegexChild(alternation, node);
+        addRegexChild(alternation, right);
+        node = alternation;
+    }
+    return node;
+}
+
+// ---- required literal ----
+
+// This method returns the byte of a set that accepts exactly one byte, or -1
+int singleByteOfSet(const unsigned char *set){
+    int found = -1;
+    for (int c = 0; c < 256; c++) {
+        if (setHasByte(set, (unsigned char)c)) {
+            if (found != -1) {
+                return -1;
+            }
+            found = c;
+        }
+    }
+    return found;
+}
+
+// This method finds the longest string every match of the node must have, it is written to best.
+// Only runs of single bytes inside concatenations are used, anything under | * or ? is optional.
+void findRequiredLiteral(const struct RegexNode *node, char *best){
+    if (node->type == REGEX_PLUS) { // its child appears at least once
+        findRequiredLiteral(node->children[0], best);
+        return;
+    }
+    if (node->type == REGEX_SET) {
+        int c = singleByteOfSet(node->set);
+        if (c > 0 && best[0] == '\0') {
+            best[0] = (char)c;
+            best[1] = '\0';
+        }
+        return;
+    }
+    if (node->type != REGEX_CONCAT) {
+        return;
+    }
+    char run[MAX_LINE];
+    size_t runLength = 0;
+    for (int i = 0; i <= node->numChildren; i++) {
+        int c = -1;
+        if (i < node->numChildren && node->children[i]->type == REGEX_SET) {
+            c = singleByteOfSet(node->children[i]->set);
+        }
+        if (c > 0 && runLength + 1 < sizeof(run)) { // the run of single bytes goes on
+            run[runLength++] = (char)c;
+            continue;
+        }
+        run[runLength] = '\0';
+        if (runLength > strlen(best)) {
+            strcpy(best, run);
+        }
+        runLength = 0;
+        if (i < node->numChildren && node->children[i]->type != REGEX_SET) {
+            char inner[MAX_LINE] = "";
+            findRequiredLiteral(node->children[i], inner);
+            if (strlen(inner) > strlen(best)) {
+                strcpy(best, inner);
+            }
+        }
+    }
+}
+
+// ---- NFA ----
+
+int addNfaState(struct Regex *regex, int type, int next, int next1){
+    if (regex->numStates == regex->capacity) {
+        regex->capacity = regex->capacity ? regex->capacity * 2 : 64;
+        regex->states = (struct NfaState*)realloc(regex->states, regex->capacity * sizeof(struct NfaState));
+    }
+    struct NfaState *state = &regex->states[regex->numStates];
+    memset(state, 0, sizeof(*state));
+    state->type = type;
+    state->next = next;
+    state->next1 = next1;
+    return regex->numStates++;
+}
+
+// This method compiles a node so that it continues with the state next, it returns the first state of the node.
+// Compiling backwards like this means no list of unfinished states is needed.
+int compileRegexNode(struct Regex *regex, const struct RegexNode *node, int next){
+    switch (node->type) {
+        case REGEX_SET: {
+            int state = addNfaState(regex, REGEX_SET, next, -1);
+            memcpy(regex->states[state].set, node->set, sizeof(node->set));
+            return state;
+        }
+        case REGEX_CONCAT:
+            for (int i = node->numChildren - 1; i >= 0; i--) {
+                next = compileRegexNode(regex, node->children[i], next);
+            }
+            return next;
+        case REGEX_ALT: {
+            int left = compileRegexNode(regex, node->children[0], next);
+            int right = compileRegexNode(regex, node->children[1], next);
+            return addNfaState(regex, REGEX_SPLIT, left, right);
+        }
+        case REGEX_QUEST:
+            return addNfaState(regex, REGEX_SPLIT, compileRegexNode(regex, node->children[0], next), next);
+        case REGEX_STAR:
+        case REGEX_PLUS: {
+            int loop = addNfaState(regex, REGEX_SPLIT, -1, next);
+            int body = compileRegexNode(regex, node->children[0], loop);
+            regex->states[loop].next = body;
+            return node->type == REGEX_STAR ? loop : body;
+        }
+        default: // ^ and $
+            return addNfaState(regex, node->type, next, -1);
+    }
+}
+
+// This method compiles the expression of search -e, returns -1 if it is not valid
+int compileRegex(struct Regex *regex, const char *pattern){
+    const char *p = pattern;
+    struct RegexNode *root = parseRegexAlternation(&p);
+    if (root == NULL || *p != '\0') {
+        if (root != NULL) {
+            freeRegexNode(root);
+        }
+        fprintf(stderr, "Not a valid regular expression: %s\n", pattern);
+        return -1;
+    }
+    free(regex->states); // -e may be given again in the same command
+    free(regex->pattern);
+    memset(regex, 0, sizeof(*regex));
+    int match = addNfaState(regex, REGEX_MATCH, -1, -1);
+    regex->start = compileRegexNode(regex, root, match);
+    regex->pattern = strdup(pattern);
+    findRequiredLiteral(root, regex->literal);
+    freeRegexNode(root);
+    return 0;
+}
+
+// This method makes every letter of the expression match both of its cases, for search -i
+void foldRegexCase(struct Regex *regex){
+    for (int s = 0; s < regex->numStates; s++) {
+        struct NfaState *state = &regex->states[s];
+        if (state->type != REGEX_SET) {
+            continue;
+        }
+        for (int c = 'a'; c <= 'z'; c++) {
+            int upper = c - ('a' - 'A');
+            if (setHasByte(state->set, (unsigned char)c) || setHasByte(state->set, (unsigned char)upper)) {
+                addByteToSet(state->set, (unsigned char)c);
+                addByteToSet(state->set, (unsigned char)upper);
+            }
+        }
+    }
+}
+
+// ---- lazy DFA ----
+
+// This method adds an NFA state and every state reachable from it without reading a byte.
+// ^ can only be passed at the beginning of a line and $ only at the end of it.
+void addClosure(struct LazyDfa *dfa, int state, int atBol, int atEol, int *size){
+    if (state < 0 || dfa->mark[state] == dfa->generation) {
+        return;
+    }
+    dfa->mark[state] = dfa->generation;
+    const struct NfaState *nfa = &searchRegex.states[state];
+    if (nfa->type == REGEX_SPLIT) {
+        addClosure(dfa, nfa->next, atBol, atEol, size);
+        addClosure(dfa, nfa->next1, atBol, atEol, size);
+    }
+    else if (nfa->type == REGEX_BOL) {
+        if (atBol) {
+            addClosure(dfa, nfa->next, atBol, atEol, size);
+        }
+    }
+    else if (nfa->type == REGEX_EOL && atEol) {
+        addClosure(dfa, nfa->next, atBol, atEol, size);
+    }
+    else { // a byte, $ waiting for the end, or the match
+        dfa->scratch[(*size)++] = state;
+    }
+}
+
+int compareInts(const void *a, const void *b){
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+// This method forgets every DFA state, it is used when the cache is full
+void flushDfa(struct LazyDfa *dfa){
+    for (int s = 0; s < dfa->numStates; s++) {
+        free(dfa->states[s].set);
+    }
+    dfa->numStates = 0;
+    dfa->numFlushes++;
+    memset(dfa->buckets, -1, sizeof(dfa->buckets));
+}
+
+// This method finds the DFA state of the set in scratch, it is made if it does not exist yet
+int findDfaState(struct LazyDfa *dfa, int size){
+    qsort(dfa->scratch, size, sizeof(int), compareInts);
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < size; i++) {
+        hash = (hash ^ (unsigned int)dfa->scratch[i]) * 16777619u;
+    }
+    for (int s = dfa->buckets[hash & (DFA_HASH_SIZE - 1)]; s != -1; s = dfa->states[s].hashNext) {
+        if (dfa->states[s].hash == hash && dfa->states[s].setSize == size && memcmp(dfa->states[s].set, dfa->scratch, size * sizeof(int)) == 0) {
+            return s;
+        }
+    }
+    if (dfa->numStates == DFA_MAX_STATES) { // the cache is full, start again with an empty one
+        flushDfa(dfa);
+        dfa->startState = -1;
+    }
+    int id = dfa->numStates++;
+    struct DfaState *state = &dfa->states[id];
+    state->set = (int*)malloc((size + 1) * sizeof(int));
+    memcpy(state->set, dfa->scratch, size * sizeof(int));
+    state->setSize = size;
+    state->hash = hash;
+    state->hashNext = dfa->buckets[hash & (DFA_HASH_SIZE - 1)];
+    dfa->buckets[hash & (DFA_HASH_SIZE - 1)] = id;
+    memset(&dfa->transitions[id * 256], -1, 256 * sizeof(int32_t));
+
+    state->isMatch = 0;
+    state->isEolMatch = 0;
+    for (int i = 0; i < size; i++) {
+        if (searchRegex.states[state->set[i]].type == REGEX_MATCH) {
+            state->isMatch = 1;
+        }
+    }
+    // the line may also match when it ends here, if a waiting $ leads to the match
+    int *saved = (int*)malloc((size + 1) * sizeof(int));
+    memcpy(saved, state->set, size * sizeof(int));
+    dfa->generation++;
+    int eolSize = 0;
+    for (int i = 0; i < size; i++) {
+        addClosure(dfa, saved[i], 0, 1, &eolSize);
+    }
+    for (int i = 0; i < eolSize; i++) {
+        if (searchRegex.states[dfa->scratch[i]].type == REGEX_MATCH) {
+            state->isEolMatch = 1;
+        }
+    }
+    free(saved);
+    return id;
+}
+
+// This method gives the state at the beginning of a line
+int dfaStartState(struct LazyDfa *dfa){
+    if (dfa->startState == -1) {
+        dfa->generation++;
+        int size = 0;
+        addClosure(dfa, searchRegex.start, 1, 0, &size);
+        dfa->startState = findDfaState(dfa, size);
+    }
+    return dfa->startState;
+}
+
+// This method finds the state after reading a byte. The start of the expression is added again at
+// every byte, because a match can start anywhere in the line.
+int dfaNextState(struct LazyDfa *dfa, int from, unsigned char c){
+    int32_t cached = dfa->transitions[from * 256 + c];
+    if (cached != -1) {
+        return cached;
+    }
+    dfa->generation++;
+    int size = 0;
+    const struct DfaState *state = &dfa->states[from];
+    for (int i = 0; i < state->setSize; i++) {
+        const struct NfaState *nfa = &searchRegex.states[state->set[i]];
+        if (nfa->type == REGEX_SET && setHasByte(nfa->set, c)) {
+            addClosure(dfa, nfa->next, 0, 0, &size);
+        }
+    }
+    addClosure(dfa, searchRegex.start, 0, 0, &size);
+    int numFlushes = dfa->numFlushes;
+    int to = findDfaState(dfa, size);
+    if (dfa->numFlushes == numFlushes) { // after a flush from is not the same state any more
+        dfa->transitions[from * 256 + c] = to;
+    }
+    return to;
+}
+
+// This method gives the DFA of the current worker, it is made the first time
+struct LazyDfa *getThreadDfa(void){
+    if (threadDfa == NULL) {
+        struct LazyDfa *dfa = (struct LazyDfa*)calloc(1, sizeof(struct LazyDfa));
+        dfa->states = (struct DfaState*)malloc(DFA_MAX_STATES * sizeof(struct DfaState));
+        dfa->transitions = (int32_t*)malloc((size_t)DFA_MAX_STATES * 256 * sizeof(int32_t));
+        dfa->mark = (int*)calloc(searchRegex.numStates, sizeof(int));
+        dfa->scratch = (int*)malloc((searchRegex.numStates + 1) * sizeof(int));
+        memset(dfa->buckets, -1, sizeof(dfa->buckets));
+        dfa->startState = -1;
+        pthread_mutex_lock(&dfaListLock);
+        dfa->nextDfa = allDfas;
+        allDfas = dfa;
+        pthread_mutex_unlock(&dfaListLock);
+        threadDfa = dfa;
+    }
+    return threadDfa;
+}
+
+// This method frees the expression and the DFAs of all workers after a search
+void freeRegex(void){
+    while (allDfas != NULL) {
+        struct LazyDfa *dfa = allDfas;
+        allDfas = dfa->nextDfa;
+        flushDfa(dfa);
+        free(dfa->states);
+        free(dfa->transitions);
+        free(dfa->mark);
+        free(dfa->scratch);
+        free(dfa);
+    }
+    threadDfa = NULL; // the other workers are finished, only this thread still has its pointer
+    free(searchRegex.states);
+    free(searchRegex.pattern);
+    memset(&searchRegex, 0, sizeof(searchRegex));
+}
+
+// This method runs the DFA over a line without its newline, every byte is read once
+int regexMatchesLine(const char *line, size_t length){
+    struct LazyDfa *dfa = getThreadDfa();
+    int state = dfaStartState(dfa);
+    for (size_t i = 0; i < length; i++) {
+        if (dfa->states[state].isMatch) {
+            return 1;
+        }
+        state = dfaNextState(dfa, state, (unsigned char)line[i]);
+    }
+    return dfa->states[state].isMatch || dfa->states[state].isEolMatch;
+}
+
+// This method keeps a matching line in the output, and in record if it is not NULL.
+// The line has its newline if the file had one.
+// Text: the keyword is only shown when there are several of them.
+// --null: path, line number, keyword and line, each of them ends with a NUL byte.
+// --json: one JSON object in every line.
+void appendMatch(struct SearchOutput *out, struct SearchOutput *record, int lineNumber, const char *shortPath, int keywordId, const char *line, int lineLength){
+    if (record != NULL) { // the result cache keeps the line too
+        int32_t header[3] = {keywordId, lineNumber, lineLength};
+        appendBytes(record, (const char*)header, sizeof(header));
+        appendBytes(record, line, lineLength);
+    }
+    if (searchOptions.listFiles || searchOptions.countOnly) { // only the file is printed, after the search
+        return;
+    }
+    const char *keyword = searchOptions.isRegex ? searchRegex.pattern : searchOptions.keywords[keywordId];
+    int textLength = lineLength - (lineLength > 0 && line[lineLength - 1] == '\n'); // without the newline
+    if (searchOptions.format == SEARCH_FORMAT_NULL) {
+        appendBytes(out, ".", 1);
+        appendBytes(out, shortPath, strlen(shortPath) + 1);
+        appendNumber(out, lineNumber);
+        appendBytes(out, "", 1);
+        appendBytes(out, keyword, strlen(keyword) + 1);
+        appendBytes(out, line, textLength);
+        appendBytes(out, "", 1);
+    }
+    else if (searchOptions.format == SEARCH_FORMAT_JSON) {
+        appendBytes(out, "{\"path\":\".", 10);
+        appendJsonEscaped(out, shortPath, strlen(shortPath));
+        appendBytes(out, "\"", 1);
+        appendBytes(out, ",\"line\":", 8);
+        appendNumber(out, lineNumber);
+        appendBytes(out, ",\"keyword\":", 11);
+        appendJsonString(out, keyword, strlen(keyword));
+        appendBytes(out, ",\"text\":", 8);
+        appendJsonString(out, line, textLength);
+        appendBytes(out, "}\n", 2);
+    }
+    else {
+        appendBytes(out, "\t", 1);
+        appendNumber(out, lineNumber);
+        appendBytes(out, ": .", 3);
+        appendBytes(out, shortPath, strlen(shortPath));
+        if (searchOptions.numKeywords > 1) {
+            appendBytes(out, " [", 2);
+            appendBytes(out, keyword, strlen(keyword));
+            appendBytes(out, "]", 1);
+        }
+        appendBytes(out, " -> ", 4);
+        appendBytes(out, line, lineLength);
+    }
+}
+
+// This method prints the result of a file for -l (its path) and -c (its path and number of matching lines)
+void appendFileResult(struct SearchOutput *out, const char *shortPath, int numMatches){
+    if (numMatches <= 0 || !(searchOptions.listFiles || searchOptions.countOnly)) { // files without a match are not listed
+        return;
+    }
+    if (searchOptions.format == SEARCH_FORMAT_NULL) {
+        appendBytes(out, ".", 1);
+        appendBytes(out, shortPath, strlen(shortPath) + 1);
+        if (searchOptions.countOnly) {
+            appendNumber(out, numMatches);
+            appendBytes(out, "", 1);
+        }
+    }
+    else if (searchOptions.format == SEARCH_FORMAT_JSON) {
+        appendBytes(out, "{\"path\":\".", 10);
+        appendJsonEscaped(out, shortPath, strlen(shortPath));
+        appendBytes(out, "\"", 1);
+        if (searchOptions.countOnly) {
+            appendBytes(out, ",\"count\":", 9);
+            appendNumber(out, numMatches);
+        }
+        appendBytes(out, "}\n", 2);
+    }
+    else {
+        appendBytes(out, ".", 1);
+        appendBytes(out, shortPath, strlen(shortPath));
+        if (searchOptions.countOnly) {
+            appendBytes(out, ": ", 2);
+            appendNumber(out, numMatches);
+        }
+        appendBytes(out, "\n", 1);
+    }
+}
+
+// This method takes one match from the -m budget. It returns 0 if the budget is used up,
+// then the match is not printed and the search stops.
+int takeMatchBudget(void){
+    return searchOptions.maxMatches == 0 || atomic_fetch_sub(&searchMatchesLeft, 1) > 0;
+}
+
+// This method tells whether -m is reached, then no directory or file is opened any more
+int isSearchStopped(void){
+    return searchOptions.maxMatches != 0 && atomic_load(&searchMatchesLeft) <= 0;
+}
+
+// This method searchs a part of a file that starts at the beginning of line firstLine.
+// Lines are only found around the hits, so a part without the keyword costs one pass of the kernel.
+// It returns the number of matching lines, with -l it stops at the first one.
+int searchInChunk(const char *buffer, size_t length, int firstLine, const char *shortPath, struct SearchOutput *out, struct SearchOutput *record){
+    const char *end = buffer + length;
+    const char *position = buffer; // always the beginning of a line
+    const char *counted = buffer; // newlines before this point are counted
+    int lineNumber = firstLine; // line number of counted
+    int numMatches = 0;
+
+    while (position < end) {
+        int keywordId;
+        const char *hit = findKeyword(position, end - position, &keywordId);
+        if (hit == NULL) {
+            break;
+        }
+        // go back to the beginning of the line and forward to its end
+        const char *lineStart = (const char*)memrchr(position, '\n', hit - position);
+        lineStart = lineStart ? lineStart + 1 : position;
+        const char *lineEnd = (const char*)memchr(hit, '\n', end - hit);
+        lineEnd = lineEnd ? lineEnd + 1 : end; // the newline is printed too, like fgets keeps it
+        if (searchOptions.isRegex && !regexMatchesLine(lineStart, lineEnd - lineStart - (lineEnd[-1] == '\n'))) {
+            position = lineEnd; // the literal is there but the expression does not match
+            continue;
+        }
+
+        if (!takeMatchBudget()) { // -m is reached
+            break;
+        }
+        numMatches++;
+        lineNumber += (int)countNewlines(counted, lineStart - counted);
+        appendMatch(out, record, lineNumber, shortPath, keywordId, lineStart, (int)(lineEnd - lineStart)); // keep it
+        if (searchOptions.listFiles) { // one match is enough to list the file, the cache has it too
+            break;
+        }
+
+        counted = lineEnd;
+        if (lineEnd[-1] == '\n') {
+            lineNumber++;
+        }
+        position = lineEnd; // continue from the next line
+    }
+    return numMatches;
+}
+
+// This method searchs the whole content of a file at once. A binary file is skipped.
+int searchInBuffer(const char *buffer, size_t length, const char *shortPath, struct SearchOutput *out, struct SearchOutput *record){
+    if (memchr(buffer, '\0', length < BINARY_CHECK_SIZE ? length : BINARY_CHECK_SIZE) != NULL) { // a binary file
+        return 0;
+    }
+    return searchInChunk(buffer, length, 1, shortPath, out, record);
+}
+
+// A part of a big file that is searched by its own thread
+struct FileChunk{
+    const char *start; // always the beginning of a line
+    size_t length;
+    size_t numNewlines; // counted before the search, the next chunks need it for their line numbers
+    int numMatches;
+    struct SearchOutput out; // the printed lines of this part
+    struct SearchOutput record; // lines for the result cache
+    int useRecord; // 1 if the result cache is used
+    const char *shortPath;
+    struct FileChunk *chunks; // every chunk of the file
+    int index; // index of this chunk
+    pthread_barrier_t *counted; // passed when every chunk has counted its newlines
+};
+
+// Thread of a chunk. First the newlines of every chunk are counted in parallel, then each chunk
+// finds its first line number from the counts of the chunks before it and is searched.
+void *searchChunkWorker(void *param){
+    struct FileChunk *chunk = (struct FileChunk*)param;
+    chunk->numNewlines = countNewlines(chunk->start, chunk->length);
+    pthread_barrier_wait(chunk->counted);
+    size_t firstLine = 1;
+    for (int c = 0; c < chunk->index; c++) { // prefix sum of the counts
+        firstLine += chunk->chunks[c].numNewlines;
+    }
+    chunk->numMatches = searchInChunk(chunk->start, chunk->length, (int)firstLine, chunk->shortPath,
+                                      &chunk->out, chunk->useRecord ? &chunk->record : NULL);
+    return NULL;
+}
+
+// This method takes up to wanted threads for the parts of a big file, returns how many it got.
+// The workers share them, so big files searched at the same time never start more than -j threads together.
+int takeChunkThreads(int wanted){
+    int left = atomic_load(&chunkThreadsLeft);
+    while (left > 0 && !atomic_compare_exchange_weak(&chunkThreadsLeft, &left, left - (wanted < left ? wanted : left))) {
+    }
+    return left < wanted ? (left > 0 ? left : 0) : wanted;
+}
+
+// This method searchs a big mapped file on several threads. It is split into parts that end at a newline,
+// and the lines of the parts are put together in order, so the output is the same as searchInBuffer's.
+int searchInParallel(const char *buffer, size_t length, const char *shortPath, struct SearchOutput *out, struct SearchOutput *record){
+    if (memchr(buffer, '\0', BINARY_CHECK_SIZE) != NULL) { // a binary file
+        return 0;
+    }
+    int numChunks = (int)(length / PARALLEL_CHUNK_MIN);
+    if (numChunks > searchOptions.jobs) {
+        numChunks = searchOptions.jobs;
+    }
+    int numThreads = takeChunkThreads(numChunks - 1); // this thread searchs a part too
+    if (numThreads == 0) { // other big files have the threads now
+        return searchInChunk(buffer, length, 1, shortPath, out, record);
+    }
+    numChunks = numThreads + 1;
+    struct FileChunk *chunks = (struct FileChunk*)calloc(numChunks, sizeof(struct FileChunk));
+    pthread_t *threads = (pthread_t*)malloc(numChunks * sizeof(pthread_t));
+    pthread_barrier_t counted;
+    const char *end = buffer + length;
+    const char *start = buffer;
+    int numUsed = 0;
+    for (int c = 0; c < numChunks && start < end; c++) {
+        const char *chunkEnd = c == numChunks - 1 ? end : buffer + length / numChunks * (c + 1);
+        if (chunkEnd < start) {
+            chunkEnd = start;
+        }
+        const char *newline = (const char*)memchr(chunkEnd, '\n', end - chunkEnd); // a line is never split
+        chunkEnd = newline ? newline + 1 : end;
+        chunks[c].start = start;
+        chunks[c].length = chunkEnd - start;
+        chunks[c].useRecord = record != NULL;
+        chunks[c].shortPath = shortPath;
+        chunks[c].chunks = chunks;
+        chunks[c].index = c;
+        chunks[c].counted = &counted;
+        start = chunkEnd;
+        numUsed++;
+    }
+    pthread_barrier_init(&counted, NULL, numUsed);
+    for (int c = 1; c < numUsed; c++) {
+        pthread_create(&threads[c], NULL, searchChunkWorker, &chunks[c]);
+    }
+    searchChunkWorker(&chunks[0]); // this thread takes the first part
+    int numMatches = 0;
+    for (int c = 0; c < numUsed; c++) {
+        if (c > 0) {
+            pthread_join(threads[c], NULL);
+        }
+        numMatches += chunks[c].numMatches;
+        appendBytes(out, chunks[c].out.data, chunks[c].out.length);
+        if (record != NULL) {
+            appendBytes(record, chunks[c].record.data, chunks[c].record.length);
+        }
+        free(chunks[c].out.data);
+        free(chunks[c].record.data);
+    }
+    pthread_barrier_destroy(&counted);
+    free(threads);
+    free(chunks);
+    atomic_fetch_add(&chunkThreadsLeft, numThreads);
+    return numMatches;
+}
+
+// This method searchs the file line by line, it is used when the file can not be mapped.
+// Lines have no length limit, and a binary file is skipped like in searchInBuffer.
+int searchInStream(FILE *file, const char *shortPath, struct SearchOutput *out, struct SearchOutput *record){
+    static __thread char *line = NULL; // the line buffer of this thread, it grows to the longest line and is reused
+    static __thread size_t lineCapacity = 0;
+    size_t outStart = out->length, recordStart = record ? record->length : 0;
+    int numMatches = 0;
+    int lineNumber = 0; // keep the line number
+    size_t offset = 0; // bytes read before this line
+    ssize_t lineLength;
+
+    while ((lineLength = getline(&line, &lineCapacity, file)) != -1) { // a line of any length
+        lineNumber++; // increment the line number and get the new line
+        if (offset < BINARY_CHECK_SIZE && memchr(line, '\0', lineLength) != NULL) { // a binary file, forget its lines
+            out->length = outStart;
+            if (record != NULL) {
+                record->length = recordStart;
+            }
+            return 0;
+        }
+        offset += lineLength;
+
+        // search the keywords in the line
+        int keywordId;
+        if (findKeyword(line, lineLength, &keywordId) != NULL
+            && (!searchOptions.isRegex || regexMatchesLine(line, lineLength - (line[lineLength - 1] == '\n')))) {
+            if (!takeMatchBudget()) { // -m is reached
+                break;
+            }
+            numMatches++;
+            appendMatch(out, record, lineNumber, shortPath, keywordId, line, (int)lineLength); // keep it if it exists
+            if (searchOptions.listFiles) { // one match is enough to list the file, the cache has it too
+                break;
+            }
+        }
+    }
+    return numMatches;
+}
+
+// ***** FILE TYPES *****
+// search looks at the files of the chosen types, -t picks a named type and --ext adds extensions.
+// All extensions are kept in one hash table, so checking a directory entry costs one lookup however many
+// types are chosen. A file without an extension is searched if it starts with the shebang or the magic
+// bytes of a chosen type, this is checked on the content after the file is read.
+
+// A named type of search -t, the lists are separated with commas
+struct SearchType{
+    const char *name;
+    const char *extensions;
+    const char *interpreters; // shebang programs, python also matches python3
+    const char *magics; // bytes the file starts with
+};
+const struct SearchType searchTypeSets[] = {
+    {"c", "c,h,C,H", "", ""},
+    {"cpp", "cpp,cc,cxx,c++,C,hpp,hh,hxx,h++,h,H,inl,ipp,tpp", "", ""},
+    {"config", "json,yaml,yml,toml,ini,cfg,conf,cmake", "", ""},
+    {"make", "mk,mak", "make", ""},
+    {"py", "py,pyi,pyw", "python", ""},
+    {"sh", "sh,bash,zsh,ksh", "sh,bash,zsh,ksh,dash", ""},
+    {"perl", "pl,pm", "perl", ""},
+    {"xml", "xml,xsd,xsl,svg", "", "<?xml"},
+};
+
+// The chosen types of the search
+struct TypeFilter{
+    char **slots; // open addressing table of extensions, NULL is an empty slot
+    size_t numSlots; // always a power of two
+    size_t numExtensions;
+    char **interpreters;
+    int numInterpreters;
+    char **magics;
+    int numMagics;
+    uint64_t signature; // hash of the choice, a part of the result cache key
+};
+struct TypeFilter searchTypes; // the types of the last valid search
+struct TypeFilter parsedTypes; // the types of the search being read, they become searchTypes when its options are valid
+
+// This method finds the slot of an extension, it is either the extension or an empty slot
+size_t findExtensionSlot(const struct TypeFilter *types, const char *extension, size_t length){
+    size_t slot = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        slot = (slot ^ (unsigned char)extension[i]) * 1099511628211ULL;
+    }
+    for (slot &= types->numSlots - 1; types->slots[slot] != NULL; slot = (slot + 1) & (types->numSlots - 1)) {
+        if (strncmp(types->slots[slot], extension, length) == 0 && types->slots[slot][length] == '\0') {
+            break;
+        }
+    }
+    return slot;
+}
+
+// This method adds every item of a comma separated list to a list of strings, or to the extension table
+void addTypeItems(struct TypeFilter *types, const char *items, char ***list, int *numItems){
+    for (const char *p = items; *p; p++) {
+        types->signature = (types->signature ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    types->signature = (types->signature ^ (list == NULL ? ';' : ',')) * 1099511628211ULL;
+    while (*items != '\0') {
+        if (list == NULL && *items == '.') { // .cpp is the same as cpp
+            items++;
+        }
+        size_t length = strcspn(items, ",");
+        if (length > 0 && list == NULL) { // an extension
+            if ((types->numExtensions + 1) * 2 > types->numSlots) { // keep the table at most half full
+                char **oldSlots = types->slots;
+                size_t oldNumSlots = types->numSlots;
+                types->numSlots = oldNumSlots ? oldNumSlots * 2 : 64;
+                types->slots = (char**)calloc(types->numSlots, sizeof(char*));
+                for (size_t s = 0; s < oldNumSlots; s++) {
+                    if (oldSlots[s] != NULL) {
+                        types->slots[findExtensionSlot(types, oldSlots[s], strlen(oldSlots[s]))] = oldSlots[s];
+                    }
+                }
+                free(oldSlots);
+            }
+            size_t slot = findExtensionSlot(types, items, length);
+            if (types->slots[slot] == NULL) {
+                types->slots[slot] = strndup(items, length);
+                types->numExtensions++;
+            }
+        }
+        else if (length > 0) {
+            *list = (char**)realloc(*list, (*numItems + 1) * sizeof(char*));
+            (*list)[(*numItems)++] = strndup(items, length);
+        }
+        items += length + (items[length] == ',');
+    }
+}
+
+// This method chooses a named type, returns -1 if there is no type with that name
+int addSearchType(struct TypeFilter *types, const char *name){
+    for (size_t t = 0; t < sizeof(searchTypeSets) / sizeof(searchTypeSets[0]); t++) {
+        if (!strcmp(searchTypeSets[t].name, name)) {
+            addTypeItems(types, searchTypeSets[t].extensions, NULL, NULL);
+            addTypeItems(types, searchTypeSets[t].interpreters, &types->interpreters, &types->numInterpreters);
+            addTypeItems(types, searchTypeSets[t].magics, &types->magics, &types->numMagics);
+            return 0;
+        }
+    }
+    fprintf(stderr, "Unknown file type: %s. The types are:", name);
+    for (size_t t = 0; t < sizeof(searchTypeSets) / sizeof(searchTypeSets[0]); t++) {
+        fprintf(stderr, " %s", searchTypeSets[t].name);
+    }
+    fprintf(stderr, "\n");
+    return -1;
+}
+
+// This method forgets the chosen types of a filter, they are chosen again
+void clearSearchTypes(struct TypeFilter *types){
+    for (size_t s = 0; s < types->numSlots; s++) {
+        free(types->slots[s]);
+    }
+    for (int i = 0; i < types->numInterpreters; i++) {
+        free(types->interpreters[i]);
+    }
+    for (int i = 0; i < types->numMagics; i++) {
+        free(types->magics[i]);
+    }
+    free(types->slots);
+    free(types->interpreters);
+    free(types->magics);
+    memset(types, 0, sizeof(*types));
+    types->signature = 14695981039346656037ULL;
+}
+
+// This method copies the chosen types to another filter, which has its own strings
+void copySearchTypes(struct TypeFilter *copy, const struct TypeFilter *types){
+    *copy = *types;
+    copy->slots = (char**)calloc(types->numSlots, sizeof(char*));
+    for (size_t s = 0; s < types->numSlots; s++) {
+        copy->slots[s] = types->slots[s] ? strdup(types->slots[s]) : NULL;
+    }
+    copy->interpreters = (char**)malloc((types->numInterpreters + 1) * sizeof(char*));
+    for (int i = 0; i < types->numInterpreters; i++) {
+        copy->interpreters[i] = strdup(types->interpreters[i]);
+    }
+    copy->magics = (char**)malloc((types->numMagics + 1) * sizeof(char*));
+    for (int i = 0; i < types->numMagics; i++) {
+        copy->magics[i] = strdup(types->magics[i]);
+    }
+}
+
+// This method checks the file name for the extensions search looks at. A name without an extension
+// is accepted if some type has a shebang or magic bytes, its content is checked with matchesFileHead.
+int hasSearchExtension(const struct TypeFilter *types, const char *name){
+    if (types->numSlots == 0) { // no type is chosen yet
+        return 0;
+    }
+    const char *ext = strrchr(name, '.');
+    if (ext == NULL) {
+        return types->numInterpreters > 0 || types->numMagics > 0;
+    }
+    return types->slots[findExtensionSlot(types, ext + 1, strlen(ext + 1))] != NULL;
+}
+
+// This method checks the beginning of a file without an extension against the shebangs and magic bytes
+int matchesFileHead(const struct TypeFilter *types, const char *buffer, size_t length){
+    for (int m = 0; m < types->numMagics; m++) {
+        size_t magicLength = strlen(types->magics[m]);
+        if (length >= magicLength && memcmp(buffer, types->magics[m], magicLength) == 0) {
+            return 1;
+        }
+    }
+    if (types->numInterpreters == 0 || length < 3 || buffer[0] != '#' || buffer[1] != '!') {
+        return 0;
+    }
+    // the program is the last part of the first word, or the word after env
+    const char *end = (const char*)memchr(buffer, '\n', length);
+    end = end ? end : buffer + length;
+    const char *word = buffer + 2, *program = NULL;
+    size_t programLength = 0;
+    while (word < end) {
+        while (word < end && (*word == ' ' || *word == '\t')) {
+            word++;
+        }
+        const char *wordEnd = word;
+        while (wordEnd < end && *wordEnd != ' ' && *wordEnd != '\t' && *wordEnd != '\r') {
+            wordEnd++;
+        }
+        const char *slash = (const char*)memrchr(word, '/', wordEnd - word);
+        program = slash ? slash + 1 : word;
+        programLength = wordEnd - program;
+        if (!(programLength == 3 && memcmp(program, "env", 3) == 0) && !(program == word && *word == '-')) {
+            break; // env and its options are passed
+        }
+        word = wordEnd;
+        programLength = 0;
+    }
+    for (int i = 0; i < types->numInterpreters && programLength > 0; i++) {
+        size_t nameLength = strlen(types->interpreters[i]);
+        if (programLength < nameLength || memcmp(program, types->interpreters[i], nameLength) != 0) {
+            continue;
+        }
+        size_t p = nameLength;
+        while (p < programLength && ((program[p] >= '0' && program[p] <= '9') || program[p] == '.')) { // python3.11
+            p++;
+        }
+        if (p == programLength) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// This method tells whether the read content of a file is searched, only a file without an extension is checked
+int isSearchedContent(const struct TypeFilter *types, const char *shortPath, const char *buffer, size_t length){
+    const char *baseName = strrchr(shortPath, '/');
+    baseName = baseName ? baseName + 1 : shortPath;
+    return strchr(baseName, '.') != NULL || matchesFileHead(types, buffer, length);
+}
+
+// ***** RESULT CACHE *****
+// The matches of every searched file are remembered with the identity and stamp of the file
+// (dev, inode, mtime, size) and a hash of what was searched. When the same search comes again,
+// a file that did not change costs one stat: its lines are printed from the cache without opening it.
+// A file without matches is remembered too. search --cache save|load|clear keeps the cache in a file.
+
+// Results of one file for one search. The records are: keyword id, line number, line length (all int32)
+// and the line itself, for every matching line.
+struct CachedResult{
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint64_t size;
+    uint64_t specHash; // hash of the keywords or the expression
+    char *records;
+    uint32_t recordsLength; // 0 if the file has no match
+    struct CachedResult *next; // next result in the same bucket
+};
+
+// The cache is split into shards with their own locks, so the workers rarely wait for each other
+struct CacheShard{
+    struct CachedResult **buckets;
+    size_t numBuckets;
+    size_t numResults;
+    pthread_mutex_t lock;
+};
+struct CacheShard resultCache[RESULT_CACHE_SHARDS];
+atomic_size_t resultCacheBytes; // memory used by the records, new results are not kept over the limit
+
+// This method gives the bucket hash of a file and search
+uint64_t hashCacheKey(uint64_t dev, uint64_t ino, uint64_t specHash){
+    uint64_t hash = (dev * 0x9E3779B97F4A7C15ULL) ^ (ino * 0xC2B2AE3D27D4EB4FULL) ^ specHash;
+    return hash ^ (hash >> 29);
+}
+
+// This method finds the result of a file, NULL if it is not cached. The shard must be locked.
+struct CachedResult *findCachedResult(struct CacheShard *shard, uint64_t hash, const struct stat *fileStat, uint64_t specHash){
+    if (shard->numBuckets == 0) {
+        return NULL;
+    }
+    for (struct CachedResult *result = shard->buckets[(hash >> 8) & (shard->numBuckets - 1)]; result != NULL; result = result->next) {
+        if (result->dev == (uint64_t)fileStat->st_dev && result->ino == (uint64_t)fileStat->st_ino && result->specHash == specHash) {
+            return result;
+        }
+    }
+    return NULL;
+}
+
+// This method prints the cached lines of a file if the file did not change.
+// It returns 1 if the file was found in the cache, then numMatches is its number of matching lines.
+int replayCachedResult(const struct stat *fileStat, const char *shortPath, struct SearchOutput *out, int *numMatches){
+    uint64_t hash = hashCacheKey(fileStat->st_dev, fileStat->st_ino, searchOptions.specHash);
+    struct CacheShard *shard = &resultCache[hash % RESULT_CACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    struct CachedResult *result = findCachedResult(shard, hash, fileStat, searchOptions.specHash);
+    int isHit = result != NULL && hasSameStamp(fileStat, result->dev, result->ino, result->mtimeSec, result->mtimeNsec, result->size);
+    if (isHit) {
+        *numMatches = 0;
+        for (uint32_t offset = 0; offset < result->recordsLength; ) {
+            int32_t header[3]; // keyword id, line number, length
+            memcpy(header, result->records + offset, sizeof(header));
+            offset += sizeof(header);
+            appendMatch(out, NULL, header[1], shortPath, header[0], result->records + offset, header[2]);
+            offset += header[2];
+            (*numMatches)++;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return isHit;
+}
+
+// This method keeps the result of a file that was just searched, the records are taken by the cache
+void storeCachedResult(const struct stat *fileStat, uint64_t specHash, struct SearchOutput *record){
+    if (atomic_load(&resultCacheBytes) + record->length > RESULT_CACHE_MAX_BYTES) { // the cache is full
+        return;
+    }
+    uint64_t hash = hashCacheKey(fileStat->st_dev, fileStat->st_ino, specHash);
+    struct CacheShard *shard = &resultCache[hash % RESULT_CACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    struct CachedResult *result = findCachedResult(shard, hash, fileStat, specHash);
+    if (result == NULL) {
+        if (shard->numResults >= shard->numBuckets) { // grow the table
+            size_t newNumBuckets = shard->numBuckets ? shard->numBuckets * 2 : 256;
+            struct CachedResult **newBuckets = (struct CachedResult**)calloc(newNumBuckets, sizeof(struct CachedResult*));
+            for (size_t b = 0; b < shard->numBuckets; b++) {
+                while (shard->buckets[b] != NULL) {
+                    struct CachedResult *moved = shard->buckets[b];
+                    shard->buckets[b] = moved->next;
+                    size_t slot = (hashCacheKey(moved->dev, moved->ino, moved->specHash) >> 8) & (newNumBuckets - 1);
+                    moved->next = newBuckets[slot];
+                    newBuckets[slot] = moved;
+                }
+            }
+            free(shard->buckets);
+            shard->buckets = newBuckets;
+            shard->numBuckets = newNumBuckets;
+        }
+        result = (struct CachedResult*)calloc(1, sizeof(struct CachedResult));
+        size_t slot = (hash >> 8) & (shard->numBuckets - 1);
+        result->next = shard->buckets[slot];
+        shard->buckets[slot] = result;
+        shard->numResults++;
+    }
+    else { // the file changed, the old records are replaced
+        atomic_fetch_sub(&resultCacheBytes, result->recordsLength);
+        free(result->records);
+    }
+    result->dev = fileStat->st_dev;
+    result->ino = fileStat->st_ino;
+    result->mtimeSec = fileStat->st_mtim.tv_sec;
+    result->mtimeNsec = fileStat->st_mtim.tv_nsec;
+    result->size = fileStat->st_size;
+    result->specHash = specHash;
+    result->records = record->data;
+    result->recordsLength = (uint32_t)record->length;
+    atomic_fetch_add(&resultCacheBytes, record->length);
+    record->data = NULL;
+    record->length = 0;
+    record->capacity = 0;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// This method forgets every cached result
+void clearResultCache(void){
+    for (int s = 0; s < RESULT_CACHE_SHARDS; s++) {
+        struct CacheShard *shard = &resultCache[s];
+        pthread_mutex_lock(&shard->lock);
+        for (size_t b = 0; b < shard->numBuckets; b++) {
+            while (shard->buckets[b] != NULL) {
+                struct CachedResult *result = shard->buckets[b];
+                shard->buckets[b] = result->next;
+                free(result->records);
+                free(result);
+            }
+        }
+        free(shard->buckets);
+        shard->buckets = NULL;
+        shard->numBuckets = 0;
+        shard->numResults = 0;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    atomic_store(&resultCacheBytes, 0);
+}
+
+// This method writes the cache to RESULT_CACHE_NAME in the current directory
+int saveResultCache(void){
+    char cachePath[PATH_MAX + sizeof(RESULT_CACHE_NAME) + 1];
+    snprintf(cachePath, sizeof(cachePath), "%s/%s", searchOptions.rootDir, RESULT_CACHE_NAME);
+    FILE *file = fopen(cachePath, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open file.\n");
+        return -1;
+    }
+    size_t numSaved = 0;
+    fwrite(RESULT_CACHE_MAGIC, 1, 8, file);
+    for (int s = 0; s < RESULT_CACHE_SHARDS; s++) {
+        struct CacheShard *shard = &resultCache[s];
+        for (size_t b = 0; b < shard->numBuckets; b++) {
+            for (struct CachedResult *result = shard->buckets[b]; result != NULL; result = result->next) {
+                uint64_t fields[7] = {result->dev, result->ino, (uint64_t)result->mtimeSec, (uint64_t)result->mtimeNsec,
+                                      result->size, result->specHash, result->recordsLength};
+                fwrite(fields, sizeof(fields), 1, file);
+                fwrite(result->records, 1, result->recordsLength, file);
+                numSaved++;
+            }
+        }
+    }
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Failed to write the search cache.\n");
+        return -1;
+    }
+    printf("Search cache saved: %zu files.\n", numSaved);
+    return 0;
+}
+
+// This method reads the cache written by saveResultCache, the results are added to the ones in memory
+int loadResultCache(void){
+    char cachePath[PATH_MAX + sizeof(RESULT_CACHE_NAME) + 1];
+    snprintf(cachePath, sizeof(cachePath), "%s/%s", searchOptions.rootDir, RESULT_CACHE_NAME);
+    FILE *file = fopen(cachePath, "r");
+    if (file == NULL) {
+        fprintf(stderr, "No search cache found.\n");
+        return -1;
+    }
+    char magic[8];
+    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, RESULT_CACHE_MAGIC, 8) != 0) {
+        fprintf(stderr, "The search cache is not valid.\n");
+        fclose(file);
+        return -1;
+    }
+    size_t numLoaded = 0;
+    uint64_t fields[7];
+    while (fread(fields, sizeof(fields), 1, file) == 1) {
+        struct stat fileStat;
+        memset(&fileStat, 0, sizeof(fileStat));
+        fileStat.st_dev = fields[0];
+        fileStat.st_ino = fields[1];
+        fileStat.st_mtim.tv_sec = (time_t)fields[2];
+        fileStat.st_mtim.tv_nsec = (long)fields[3];
+        fileStat.st_size = (off_t)fields[4];
+        struct SearchOutput record = {NULL, 0, 0};
+        if (fields[6] > 0) {
+            reserveOutput(&record, fields[6]);
+            if (fread(record.data, 1, fields[6], file) != fields[6]) { // the file is cut
+                free(record.data);
+                break;
+            }
+            record.length = fields[6];
+        }
+        storeCachedResult(&fileStat, fields[5], &record);
+        free(record.data);
+        numLoaded++;
+    }
+    fclose(file);
+    printf("Search cache loaded: %zu files.\n", numLoaded);
+    return 0;
+}
+
+// This method searches an open file of the given stat and closes it
+int searchOpenedFile(int fd, const char *shortPath, struct SearchOutput *out, struct SearchOutput *record, struct stat *fileStat){
+    // we keep the number of matching lines
+    int numMatches = 0;
+    void *mapped = mmap(NULL, fileStat->st_size, PROT_READ, MAP_PRIVATE, fd, 0); // map the whole file
+    if (mapped != MAP_FAILED) {
+        madvise(mapped, fileStat->st_size, MADV_SEQUENTIAL); // it is read once from the beginning
+        if (!isSearchedContent(searchOptions.types, shortPath, (const char*)mapped, fileStat->st_size)) { // no extension and no known shebang
+            numMatches = 0;
+        }
+        else if (fileStat->st_size >= PARALLEL_FILE_SIZE && searchOptions.jobs > 1 && searchOptions.maxMatches == 0
+                 && !searchOptions.listFiles) { // a huge file is shared by several threads, -m and -l need its matches in order
+            numMatches = searchInParallel((const char*)mapped, fileStat->st_size, shortPath, out, record);
+        }
+        else {
+            numMatches = searchInBuffer((const char*)mapped, fileStat->st_size, shortPath, out, record);
+        }
+        munmap(mapped, fileStat->st_size);
+        close(fd);
+    }
+    else { // mapping is not possible, read it line by line
+        FILE *file = fdopen(fd, "r");
+        if (file == NULL) {
+            close(fd);
+            return -1;
+        }
+        numMatches = searchInStream(file, shortPath, out, record);
+        fclose(file); // close the file
+    }
+    return numMatches; // return the found information
+}
+
+// This method searchs in the file for search implementeation, the printed lines are collected in out.
+// The file is opened relative to its directory, filePath is only used for printing.
+// If record is not NULL the lines are also kept there for the cache, with the stat of the file.
+// It returns the number of matching lines, -1 if the file can not be read.
+int searchInFile(int dirFd, const char *name, const char *filePath, struct SearchOutput *out, struct SearchOutput *record, struct stat *fileStat) {
+    // instead of the full path name, we used . for the current directory as in the output given from the pdf
+    const char *shortPath = filePath + searchOptions.rootLen; // now the file path is ./xx instead of /home/desktop/...
+
+    int fd = openat(dirFd, name, O_RDONLY | O_CLOEXEC); // open the file 
+    if (fd == -1) {
+        fprintf(stderr, "Error opening file: %s\n", filePath); // if it fails give error
+        return -1;
+    }
+    if (fstat(fd, fileStat) == -1) {
+        fprintf(stderr, "Error opening file: %s\n", filePath);
+        close(fd);
+        return -1;
+    }
+    if (fileStat->st_size == 0 || (searchOptions.maxFileSize > 0 && fileStat->st_size > searchOptions.maxFileSize)) { // nothing to search, or too big
+        close(fd);
+        return 0;
+    }
+    return searchOpenedFile(fd, shortPath, out, record, fileStat);
+}
+
+// ***** IGNORE FILES *****
+// Directories and files named in .gitignore files, and the --exclude globs, are not searched.
+// An ignored directory is never opened, so build output and dependencies cost nothing.
+// The rules are like git's: a pattern without / matches the name at any depth, a pattern with /
+// matches the path from its ignore file's directory, pattern/ matches only directories,
+// !pattern searches a path again, and the last matching rule of the deepest file wins.
+
+// This method matches text with a glob: * and ? do not match /, ** matches any number of directories,
+// [abc], [a-z] and [!abc] are classes and \ escapes the next character
+int matchGlob(const char *glob, const char *text){
+    while (*glob != '\0') {
+        if (glob[0] == '*' && glob[1] == '*') {
+            glob += 2;
+            if (*glob == '\0') { // everything below
+                return 1;
+            }
+            if (*glob == '/') { // **/ is also zero directories
+                glob++;
+            }
+            while (1) { // try every directory start
+                if (matchGlob(glob, text)) {
+                    return 1;
+                }
+                while (*text != '\0' && *text != '/') {
+                    text++;
+                }
+                if (*text == '\0') {
+                    return 0;
+                }
+                text++;
+            }
+        }
+        if (*glob == '*') {
+            glob++;
+            while (1) {
+                if (matchGlob(glob, text)) {
+                    return 1;
+                }
+                if (*text == '\0' || *text == '/') {
+                    return 0;
+                }
+                text++;
+            }
+        }
+        if (*text == '\0') {
+            return 0;
+        }
+        if (*glob == '?') {
+            if (*text == '/') {
+                return 0;
+            }
+        }
+        else if (*glob == '[') {
+            const char *p = glob + 1;
+            int isNegated = (*p == '!' || *p == '^');
+            if (isNegated) {
+                p++;
+            }
+            int isMatched = 0;
+            for (const char *first = p; *p != '\0' && (*p != ']' || p == first); ) { // a ] right after [ is a character of the class
+                if (p[1] == '-' && p[2] != '\0' && p[2] != ']') {
+                    isMatched |= (unsigned char)*text >= (unsigned char)p[0] && (unsigned char)*text <= (unsigned char)p[2];
+                    p += 3;
+                }
+                else {
+                    isMatched |= *p == *text;
+                    p++;
+                }
+            }
+            if (*p == '\0') { // no closing ], the [ is a normal character
+                if (*text != '[') {
+                    return 0;
+                }
+            }
+            else {
+                if (isMatched == isNegated || *text == '/') {
+                    return 0;
+                }
+                glob = p;
+            }
+        }
+        else {
+            if (*glob == '\\' && glob[1] != '\0') {
+                glob++;
+            }
+            if (*glob != *text) {
+                return 0;
+            }
+        }
+        glob++;
+        text++;
+    }
+    return *text == '\0';
+}
+
+// This method compiles a line of an ignore file, it returns 0 for an empty line or a comment
+int compileIgnorePattern(const char *line, struct IgnorePattern *pattern){
+    size_t length = strlen(line);
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r' || line[length - 1] == ' ')) {
+        length--;
+    }
+    if (length == 0 || line[0] == '#') {
+        return 0;
+    }
+    pattern->isNegated = line[0] == '!';
+    if (pattern->isNegated || (line[0] == '\\' && (line[1] == '!' || line[1] == '#'))) {
+        line++;
+        length--;
+    }
+    pattern->isDirOnly = length > 0 && line[length - 1] == '/';
+    if (pattern->isDirOnly) {
+        length--;
+    }
+    pattern->isAnchored = memchr(line, '/', length) != NULL;
+    if (length > 0 && line[0] == '/') {
+        line++;
+        length--;
+    }
+    if (length == 0) {
+        return 0;
+    }
+    pattern->glob = strndup(line, length);
+    pattern->globLength = length;
+    pattern->kind = IGNORE_GLOB;
+    if (strpbrk(pattern->glob, "*?[\\") == NULL) {
+        pattern->kind = IGNORE_LITERAL;
+    }
+    else if (!pattern->isAnchored && pattern->glob[0] == '*' && strpbrk(pattern->glob + 1, "*?[\\") == NULL) {
+        pattern->kind = IGNORE_SUFFIX; // *.o and the like
+    }
+    return 1;
+}
+
+// This method adds a compiled pattern to a list
+void addIgnorePattern(struct IgnoreList *list, const char *line){
+    struct IgnorePattern pattern;
+    if (compileIgnorePattern(line, &pattern)) {
+        list->patterns = (struct IgnorePattern*)realloc(list->patterns, (list->numPatterns + 1) * sizeof(struct IgnorePattern));
+        list->patterns[list->numPatterns++] = pattern;
+    }
+}
+
+// This method gives up a directory's use of a list, the last one frees it and its parents
+void releaseIgnoreList(struct IgnoreList *list){
+    while (list != NULL && atomic_fetch_sub(&list->refs, 1) == 1) {
+        struct IgnoreList *parent = list->parent;
+        for (int p = 0; p < list->numPatterns; p++) {
+            free(list->patterns[p].glob);
+        }
+        free(list->patterns);
+        free(list);
+        list = parent;
+    }
+}
+
+// This method reads the ignore file in a directory, relPath is the directory from the root.
+// It returns the new list of the directory, or parent if the file has no rule.
+struct IgnoreList *loadIgnoreFile(int dirFd, const char *relPath, struct IgnoreList *parent){
+    int fd = openat(dirFd, SEARCH_IGNORE_NAME, O_RDONLY | O_CLOEXEC);
+    FILE *file = fd == -1 ? NULL : fdopen(fd, "r");
+    if (file == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return parent;
+    }
+    struct IgnoreList *list = (struct IgnoreList*)calloc(1, sizeof(struct IgnoreList));
+    char *line = NULL;
+    size_t capacity = 0;
+    while (getline(&line, &capacity, file) != -1) {
+        addIgnorePattern(list, line);
+    }
+    free(line);
+    fclose(file);
+    if (list->numPatterns == 0) {
+        free(list->patterns);
+        free(list);
+        return parent;
+    }
+    list->baseLength = relPath[0] == '\0' ? 0 : strlen(relPath) + 1;
+    list->parent = parent;
+    atomic_init(&list->refs, 1);
+    if (parent != NULL) {
+        atomic_fetch_add(&parent->refs, 1);
+    }
+    return list;
+}
+
+// This method checks a path with the rules of one list. It returns 1 if the path is ignored,
+// 0 if a negated rule searches it again and -1 if no rule matches.
+int matchIgnoreList(const struct IgnoreList *list, const char *relPath, const char *name, int isDir){
+    const char *path = relPath + list->baseLength; // the path from the ignore file's directory
+    size_t nameLength = strlen(name);
+    for (int p = list->numPatterns - 1; p >= 0; p--) { // the last matching rule wins
+        const struct IgnorePattern *pattern = &list->patterns[p];
+        if (pattern->isDirOnly && !isDir) {
+            continue;
+        }
+        const char *text = pattern->isAnchored ? path : name;
+        int isMatched;
+        if (pattern->kind == IGNORE_LITERAL) {
+            isMatched = strcmp(pattern->glob, text) == 0;
+        }
+        else if (pattern->kind == IGNORE_SUFFIX) {
+            isMatched = nameLength >= pattern->globLength - 1
+                        && memcmp(name + nameLength - (pattern->globLength - 1), pattern->glob + 1, pattern->globLength - 1) == 0;
+        }
+        else {
+            isMatched = matchGlob(pattern->glob, text);
+        }
+        if (isMatched) {
+            return !pattern->isNegated;
+        }
+    }
+    return -1;
+}
+
+// This method checks whether a file or directory is left out of the search.
+// relPath is its path from the root and ignore is the list of its directory.
+int isIgnoredPath(const struct IgnoreList *ignore, const char *relPath, const char *name, int isDir){
+    if (searchOptions.excludes != NULL && matchIgnoreList(searchOptions.excludes, relPath, name, isDir) == 1) {
+        return 1;
+    }
+    if (isDir && !strcmp(name, ".git") && searchOptions.useIgnoreFiles) { // git's own files are never searched
+        return 1;
+    }
+    for (; ignore != NULL; ignore = ignore->parent) {
+        int result = matchIgnoreList(ignore, relPath, name, isDir);
+        if (result != -1) {
+            return result;
+        }
+    }
+    return 0;
+}
+
+// ***** VISITED FILES *****
+// Every directory and file of a search is marked with its (device, inode) pair. A tree that is bind mounted
+// or linked twice is read once, a file with several hard links is searched once, and with -L a link
+// back to a directory above can not make the walk go around forever.
+
+// This method marks a file or directory, it returns 1 if it was not marked before in this search
+int markVisited(uint64_t dev, uint64_t ino){
+    if (ino == 0) { // no identity is known
+        return 1;
+    }
+    uint64_t hash = hashCacheKey(dev, ino, 0);
+    struct VisitedShard *shard = &visitedFiles[hash % VISITED_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    if ((shard->numIds + 1) * 2 > shard->capacity) { // keep the table at most half full
+        size_t newCapacity = shard->capacity ? shard->capacity * 2 : 1024;
+        struct FileId *newIds = (struct FileId*)calloc(newCapacity, sizeof(struct FileId));
+        for (size_t i = 0; i < shard->capacity; i++) {
+            if (shard->ids[i].ino != 0) {
+                size_t slot = (hashCacheKey(shard->ids[i].dev, shard->ids[i].ino, 0) >> 8) & (newCapacity - 1);
+                while (newIds[slot].ino != 0) {
+                    slot = (slot + 1) & (newCapacity - 1);
+                }
+                newIds[slot] = shard->ids[i];
+            }
+        }
+        free(shard->ids);
+        shard->ids = newIds;
+        shard->capacity = newCapacity;
+    }
+    size_t slot = (hash >> 8) & (shard->capacity - 1);
+    for (; shard->ids[slot].ino != 0; slot = (slot + 1) & (shard->capacity - 1)) {
+        if (shard->ids[slot].dev == dev && shard->ids[slot].ino == ino) {
+            pthread_mutex_unlock(&shard->lock);
+            return 0;
+        }
+    }
+    shard->ids[slot].dev = dev;
+    shard->ids[slot].ino = ino;
+    shard->numIds++;
+    pthread_mutex_unlock(&shard->lock);
+    return 1;
+}
+
+// This method forgets the marks of a finished search
+void clearVisited(void){
+    for (int s = 0; s < VISITED_SHARDS; s++) {
+        free(visitedFiles[s].ids);
+        visitedFiles[s].ids = NULL;
+        visitedFiles[s].capacity = 0;
+        visitedFiles[s].numIds = 0;
+    }
+}
+
+// This method gives up a task's use of its directory, the last one closes it
+void releaseSearchDir(struct SearchDir *dir){
+    if (dir != NULL && atomic_fetch_sub(&dir->refs, 1) == 1) {
+        releaseIgnoreList(dir->ignore);
+        close(dir->fd);
+        free(dir->path);
+        free(dir);
+    }
+}
+
+// This method gives the full path of a task, the caller frees it
+char *buildTaskPath(const struct SearchTask *task){
+    if (task->dir == NULL) {
+        return strdup(task->name);
+    }
+    size_t nameLength = strlen(task->name);
+    char *path = (char*)malloc(task->dir->pathLength + nameLength + 2);
+    memcpy(path, task->dir->path, task->dir->pathLength);
+    path[task->dir->pathLength] = '/';
+    memcpy(path + task->dir->pathLength + 1, task->name, nameLength + 1);
+    return path;
+}
+
+// Search in the directory, files and subdirectories found are given to the pool as new tasks.
+// The directory is read with getdents64 into a large buffer, so a directory with many entries
+// needs only a few system calls. There is no limit on the depth or on the length of a path.
+void searchInDirectory(struct SearchPool *pool, int workerId, struct SearchTask *task) {
+    if (isSearchStopped()) { // -m is reached, nothing more is read
+        return;
+    }
+    int openFlags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (searchOptions.followSymlinks ? 0 : O_NOFOLLOW);
+    int dirFd = openat(task->dir ? task->dir->fd : AT_FDCWD, task->name, openFlags); // open the directory
+    char *dirPath = buildTaskPath(task);
+    struct stat dirStat;
+    if (dirFd == -1 || fstat(dirFd, &dirStat) == -1) { 
+        fprintf(stderr, "Error opening directory: %s\n", dirPath); // if fails give error
+        if (dirFd != -1) {
+            close(dirFd);
+        }
+        free(dirPath);
+        return;
+    }
+    if (!markVisited(dirStat.st_dev, dirStat.st_ino)) { // a bind mount or a symlink cycle, it is already read
+        close(dirFd);
+        free(dirPath);
+        return;
+    }
+    if (searchOptions.mode == SEARCH_MODE_SYNC_INDEX) { // the watcher needs every directory of the tree
+        watchIndexDirectory(dirPath);
+    }
+    int followedWd = -1;
+    if (searchOptions.watchResults) { // search -w follows every directory it searched
+        followedWd = followDirectory(dirPath);
+    }
+    struct SearchDir *dir = (struct SearchDir*)malloc(sizeof(struct SearchDir));
+    dir->fd = dirFd;
+    atomic_init(&dir->refs, 1); // this reference is given up after reading
+    dir->path = dirPath;
+    dir->pathLength = strlen(dirPath);
+    dir->depth = task->dir ? task->dir->depth + 1 : 0;
+    dir->ignore = task->dir ? task->dir->ignore : NULL; // the rules of the parent apply here too
+    if (dir->ignore != NULL) {
+        atomic_fetch_add(&dir->ignore->refs, 1);
+    }
+    int hasIgnoreFile = 0;
+
+    // the children are collected first and pushed in reverse order,
+    // so that the owner pops them in the same order as getdents64 returned them
+    struct SearchTask *children = NULL;
+    struct FileId *childIds = NULL; // identity of the files, a file with several names is searched once
+    int numChildren = 0, childCapacity = 0;
+
+    char *buffer = (char*)malloc(DIRENT_BUFFER_SIZE);
+    ssize_t length;
+    while ((length = getdents64(dirFd, buffer, DIRENT_BUFFER_SIZE)) > 0) { // until there is no entry left
+        for (ssize_t offset = 0; offset < length; ) {
+            struct dirent64 *entry = (struct dirent64*)(buffer + offset); // it will save the directory entries
+            offset += entry->d_reclen;
+            if (!strcmp(entry->d_name, SEARCH_IGNORE_NAME)) {
+                hasIgnoreFile = 1;
+            }
+            unsigned char type = entry->d_type;
+            struct FileId id = {(uint64_t)dirStat.st_dev, entry->d_ino};
+            // some file systems do not give the type, and with -L a link is replaced by what it points to
+            if (type == DT_UNKNOWN || (type == DT_LNK && searchOptions.followSymlinks)) {
+                struct stat entryStat;
+                if (fstatat(dirFd, entry->d_name, &entryStat, searchOptions.followSymlinks ? 0 : AT_SYMLINK_NOFOLLOW) == -1) {
+                    continue;
+                }
+                type = S_ISREG(entryStat.st_mode) ? DT_REG : (S_ISDIR(entryStat.st_mode) ? DT_DIR : DT_UNKNOWN);
+                id.dev = entryStat.st_dev;
+                id.ino = entryStat.st_ino;
+            }
+            int isDir = 0;
+            if (type == DT_REG) { // if the type is regular file flag
+                if (!hasSearchExtension(searchOptions.types, entry->d_name)) {
+                    continue;
+                }
+            }
+            // if it is recursive
+            else if (searchOptions.recursive && type == DT_DIR && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0 // check the type if directory and dont have . or ..
+                     && (searchOptions.maxDepth < 0 || dir->depth + 1 < searchOptions.maxDepth)) { // --max-depth 1 is only the files here
+                isDir = 1;
+            }
+            else {
+                continue;
+            }
+
+            if (numChildren == childCapacity) {
+                childCapacity = childCapacity ? childCapacity * 2 : 16;
+                children = (struct SearchTask*)realloc(children, childCapacity * sizeof(struct SearchTask));
+                childIds = (struct FileId*)realloc(childIds, childCapacity * sizeof(struct FileId));
+            }
+            childIds[numChildren] = id;
+            children[numChildren].dir = dir;
+            children[numChildren].name = strdup(entry->d_name); // only the name, the path is known from dir
+            children[numChildren].isDir = isDir;
+            numChildren++;
+        }
+    }
+    if (length == -1) {
+        fprintf(stderr, "Error reading directory: %s\n", dirPath);
+    }
+    free(buffer);
+
+    // the ignored children and the files already seen are dropped before they become tasks,
+    // so an ignored directory is never opened
+    const char *relPath = dirPath + searchOptions.rootLen + (dirPath[searchOptions.rootLen] == '/'); // path from the root
+    if (hasIgnoreFile && searchOptions.useIgnoreFiles) {
+        struct IgnoreList *ignore = loadIgnoreFile(dirFd, relPath, dir->ignore);
+        if (ignore != dir->ignore) {
+            releaseIgnoreList(dir->ignore);
+            dir->ignore = ignore;
+        }
+    }
+    if (followedWd != -1) { // the changed files of this directory are checked with the same rules
+        setFollowedIgnores(followedWd, dir->ignore);
+    }
+    int hasIgnoreRules = dir->ignore != NULL || searchOptions.excludes != NULL || searchOptions.useIgnoreFiles;
+    size_t relLength = strlen(relPath);
+    char *childPath = NULL;
+    size_t childPathCapacity = 0;
+    int numKept = 0;
+    for (int i = 0; i < numChildren; i++) {
+        int isDropped = 0;
+        if (hasIgnoreRules) {
+            size_t nameLength = strlen(children[i].name);
+            if (relLength + nameLength + 2 > childPathCapacity) {
+                childPathCapacity = (relLength + nameLength + 2) * 2;
+                childPath = (char*)realloc(childPath, childPathCapacity);
+            }
+            size_t prefixLength = 0;
+            if (relLength > 0) {
+                memcpy(childPath, relPath, relLength);
+                childPath[relLength] = '/';
+                prefixLength = relLength + 1;
+            }
+            memcpy(childPath + prefixLength, children[i].name, nameLength + 1);
+            isDropped = isIgnoredPath(dir->ignore, childPath, children[i].name, children[i].isDir);
+        }
+        // a file seen under another name is dropped, directories are checked when they are opened
+        if (!isDropped && !children[i].isDir && !markVisited(childIds[i].dev, childIds[i].ino)) {
+            isDropped = 1;
+        }
+        if (isDropped) {
+            free(children[i].name);
+        }
+        else {
+            children[numKept++] = children[i];
+        }
+    }
+    free(childPath);
+    free(childIds);
+    numChildren = numKept;
+
+    atomic_fetch_add(&dir->refs, numChildren); // every child keeps the directory open
+    for (int i = numChildren - 1; i >= 0; i--) {
+        submitTask(pool, workerId, children[i].dir, children[i].name, children[i].isDir);
+    }
+    free(children);
+    releaseSearchDir(dir);
+}
+
+// This method runs a task and frees it
+void runTask(struct SearchPool *pool, int workerId, struct SearchTask *task){
+    if (task->isDir) {
+        searchInDirectory(pool, workerId, task);
+    }
+    else {
+        int dirFd = task->dir ? task->dir->fd : AT_FDCWD;
+        char *filePath = buildTaskPath(task);
+        if (searchOptions.mode == SEARCH_MODE_BUILD_INDEX) {
+            indexFile(workerId, dirFd, task->name, filePath);
+        }
+        else if (searchOptions.mode == SEARCH_MODE_SYNC_INDEX) {
+            updateIndexEntry(filePath + searchOptions.rootLen);
+        }
+        else {
+            struct SearchOutput out = {NULL, 0, 0};
+            struct stat fileStat;
+            int numMatches = 0;
+            if (isSearchStopped()) { // -m is reached, the file is not opened
+                numMatches = 0;
+            }
+            // a file that did not change since the same search is not opened at all
+            else if (!searchOptions.useCache || fstatat(dirFd, task->name, &fileStat, 0) == -1
+                || !replayCachedResult(&fileStat, filePath + searchOptions.rootLen, &out, &numMatches)) {
+                struct SearchOutput record = {NULL, 0, 0};
+                numMatches = searchInFile(dirFd, task->name, filePath, &out, searchOptions.useCache ? &record : NULL, &fileStat);
+                if (searchOptions.useCache && numMatches != -1) {
+                    storeCachedResult(&fileStat, searchOptions.specHash, &record);
+                }
+                free(record.data);
+            }
+            appendFileResult(&out, filePath + searchOptions.rootLen, numMatches);
+            if (searchOptions.watchResults && numMatches != -1) { // search -w goes on from here when it changes
+                rememberFollowedFile(filePath + searchOptions.rootLen, fileStat.st_size);
+            }
+            if (numMatches > 0) {
+                atomic_store(&pool->isFound, 1);
+            }
+            writeResults(&pool->writers[workerId], &out); // the whole file goes out at once
+        }
+        free(filePath);
+    }
+    releaseSearchDir(task->dir);
+    free(task->name);
+}
+
+// ***** IO_URING READS *****
+// A worker that has an io_uring takes the files at the bottom of its deque as a batch. Their opens are
+// queued together, then the reads, and every file is searched as soon as its read completes.
+// Big files are still mapped, since they are already read in large requests.
+// If io_uring can not be set up (old kernel, or forbidden), the worker searches with blocking reads.
+
+// This method sets up the io_uring of a worker, it returns -1 if io_uring is not available
+int openUringReader(struct UringReader *reader){
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    reader->ringFd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (reader->ringFd == -1) {
+        return -1;
+    }
+    reader->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    reader->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) { // both rings are in one mapping
+        if (reader->cqRingSize > reader->sqRingSize) {
+            reader->sqRingSize = reader->cqRingSize;
+        }
+        reader->cqRingSize = reader->sqRingSize;
+    }
+    reader->sqRing = mmap(NULL, reader->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, reader->ringFd, IORING_OFF_SQ_RING);
+    reader->cqRing = reader->sqRing;
+    if (reader->sqRing != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        reader->cqRing = mmap(NULL, reader->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, reader->ringFd, IORING_OFF_CQ_RING);
+    }
+    reader->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    reader->sqes = (struct io_uring_sqe*)mmap(NULL, reader->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, reader->ringFd, IORING_OFF_SQES);
+    if (reader->sqRing == MAP_FAILED || reader->cqRing == MAP_FAILED || reader->sqes == MAP_FAILED) {
+        if (reader->sqes != MAP_FAILED) {
+            munmap(reader->sqes, reader->sqesSize);
+        }
+        if (reader->cqRing != MAP_FAILED && reader->cqRing != reader->sqRing) {
+            munmap(reader->cqRing, reader->cqRingSize);
+        }
+        if (reader->sqRing != MAP_FAILED) {
+            munmap(reader->sqRing, reader->sqRingSize);
+        }
+        close(reader->ringFd);
+        reader->ringFd = -1;
+        return -1;
+    }
+    char *sq = (char*)reader->sqRing, *cq = (char*)reader->cqRing;
+    reader->sqHead = (unsigned*)(sq + params.sq_off.head);
+    reader->sqTail = (unsigned*)(sq + params.sq_off.tail);
+    reader->sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    reader->sqArray = (unsigned*)(sq + params.sq_off.array);
+    reader->cqHead = (unsigned*)(cq + params.cq_off.head);
+    reader->cqTail = (unsigned*)(cq + params.cq_off.tail);
+    reader->cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    reader->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    reader->toSubmit = 0;
+    return 0;
+}
+
+// This method releases the io_uring of a worker
+void closeUringReader(struct UringReader *reader){
+    if (reader->ringFd == -1) {
+        return;
+    }
+    munmap(reader->sqes, reader->sqesSize);
+    if (reader->cqRing != reader->sqRing) {
+        munmap(reader->cqRing, reader->cqRingSize);
+    }
+    munmap(reader->sqRing, reader->sqRingSize);
+    close(reader->ringFd);
+    reader->ringFd = -1;
+}
+
+// This method gives the next free submission entry, it is sent with the next submitUring.
+// A batch never has more requests in flight than files, so the queue does not get full.
+struct io_uring_sqe *queueUringRequest(struct UringReader *reader, int opcode, unsigned long long userData){
+    unsigned tail = *reader->sqTail;
+    unsigned index = tail & *reader->sqMask;
+    struct io_uring_sqe *sqe = &reader->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (unsigned char)opcode;
+    sqe->user_data = userData;
+    reader->sqArray[index] = index;
+    atomic_store_explicit((_Atomic unsigned*)reader->sqTail, tail + 1, memory_order_release); // the kernel may see it now
+    reader->toSubmit++;
+    return sqe;
+}
+
+// This method sends the queued requests and waits until at least one request is complete
+int submitUring(struct UringReader *reader){
+    while (1) {
+        unsigned waitFor = atomic_load_explicit((_Atomic unsigned*)reader->cqTail, memory_order_acquire) == *reader->cqHead;
+        int submitted = (int)syscall(__NR_io_uring_enter, reader->ringFd, reader->toSubmit, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted >= 0) {
+            reader->toSubmit -= submitted;
+            if (reader->toSubmit == 0) {
+                return 0;
+            }
+        }
+        else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            fprintf(stderr, "io_uring failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+}
+
+// This method takes the next completion, it returns 0 if there is none yet
+int takeUringCompletion(struct UringReader *reader, struct io_uring_cqe *cqe){
+    unsigned head = *reader->cqHead;
+    if (head == atomic_load_explicit((_Atomic unsigned*)reader->cqTail, memory_order_acquire)) {
+        return 0;
+    }
+    *cqe = reader->cqes[head & *reader->cqMask];
+    atomic_store_explicit((_Atomic unsigned*)reader->cqHead, head + 1, memory_order_release); // the entry can be reused
+    return 1;
+}
+
+// This method queues the read of the rest of a file
+void queueUringRead(struct UringReader *reader, struct UringFile *file, int index){
+    struct io_uring_sqe *sqe = queueUringRequest(reader, IORING_OP_READ, (unsigned long long)index);
+    sqe->fd = file->fd;
+    sqe->addr = (unsigned long long)(uintptr_t)(file->buffer + file->readLength);
+    sqe->len = (unsigned)(file->fileStat.st_size - file->readLength);
+    sqe->off = file->readLength;
+}
+
+// This method handles a completed open or read of a batch. It returns 1 if a new request was queued for the file.
+int completeUringFile(struct UringReader *reader, struct UringFile *file, int index, int result){
+    const char *shortPath = file->filePath + searchOptions.rootLen;
+    struct SearchOutput *record = searchOptions.useCache ? &file->record : NULL;
+    if (file->fd == -1) { // the file is opened
+        if (result < 0 || fstat(result, &file->fileStat) == -1) {
+            fprintf(stderr, "Error opening file: %s\n", file->filePath);
+            if (result >= 0) {
+                close(result);
+            }
+            file->numMatches = -1;
+            return 0;
+        }
+        file->fd = result;
+        if (file->fileStat.st_size == 0 || (searchOptions.maxFileSize > 0 && file->fileStat.st_size > searchOptions.maxFileSize)) { // nothing to search, or too big
+            close(file->fd);
+            return 0;
+        }
+        if (file->fileStat.st_size > URING_MAX_READ) { // too big to be kept in memory, it is mapped
+            file->numMatches = searchOpenedFile(file->fd, shortPath, &file->out, record, &file->fileStat);
+            return 0;
+        }
+        file->buffer = (char*)malloc(file->fileStat.st_size);
+        queueUringRead(reader, file, index);
+        return 1;
+    }
+    if (result < 0) {
+        fprintf(stderr, "Error reading file: %s\n", file->filePath);
+        file->numMatches = -1;
+    }
+    else {
+        file->readLength += result;
+        if (result > 0 && file->readLength < (size_t)file->fileStat.st_size) { // a short read, the rest is asked again
+            queueUringRead(reader, file, index);
+            return 1;
+        }
+        // a file that got shorter is searched as far as it was read
+        if (isSearchedContent(searchOptions.types, shortPath, file->buffer, file->readLength)) { // no extension and no known shebang is skipped
+            file->numMatches = searchInBuffer(file->buffer, file->readLength, shortPath, &file->out, record);
+        }
+    }
+    free(file->buffer);
+    file->buffer = NULL;
+    close(file->fd);
+    return 0;
+}
+
+// This method searches first and the files below it in the worker's deque with io_uring.
+// It returns the number of tasks it finished. The results are written in the order of the tasks.
+int runFileBatch(struct SearchPool *pool, int workerId, struct SearchTask *first){
+    struct UringReader *reader = &pool->readers[workerId];
+    struct UringFile files[URING_BATCH];
+    int numFiles = 0;
+    files[numFiles++].task = *first;
+    while (numFiles < URING_BATCH && popTask(&pool->deques[workerId], &files[numFiles].task)) {
+        if (files[numFiles].task.isDir) { // the batch ends at a directory, it is run next
+            pushTask(&pool->deques[workerId], files[numFiles].task);
+            break;
+        }
+        numFiles++;
+    }
+
+    int inFlight = 0;
+    for (int i = 0; i < numFiles; i++) {
+        struct UringFile *file = &files[i];
+        int dirFd = file->task.dir ? file->task.dir->fd : AT_FDCWD;
+        file->filePath = buildTaskPath(&file->task);
+        file->fd = -1;
+        file->buffer = NULL;
+        file->readLength = 0;
+        file->numMatches = 0;
+        file->isPending = 0;
+        memset(&file->out, 0, sizeof(file->out));
+        memset(&file->record, 0, sizeof(file->record));
+        // a file that did not change since the same search is not opened at all, and none is opened after -m is reached
+        if (isSearchStopped() || (searchOptions.useCache && fstatat(dirFd, file->task.name, &file->fileStat, 0) == 0
+            && replayCachedResult(&file->fileStat, file->filePath + searchOptions.rootLen, &file->out, &file->numMatches))) {
+            file->fd = -2; // nothing to store in the cache
+            continue;
+        }
+        struct io_uring_sqe *sqe = queueUringRequest(reader, IORING_OP_OPENAT, (unsigned long long)i);
+        sqe->fd = dirFd;
+        sqe->addr = (unsigned long long)(uintptr_t)file->task.name;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        file->isPending = 1;
+        inFlight++;
+    }
+
+    while (inFlight > 0) {
+        if (submitUring(reader) == -1) {
+            // the completed files are closed and freed already. The kernel may still write into the buffer
+            // of a pending read, so it is left allocated, and this worker reads with blocking calls from now on.
+            for (int i = 0; i < numFiles; i++) {
+                if (files[i].isPending) {
+                    if (files[i].fd >= 0) {
+                        close(files[i].fd);
+                    }
+                    files[i].numMatches = -1;
+                }
+            }
+            closeUringReader(reader);
+            break;
+        }
+        struct io_uring_cqe cqe;
+        while (takeUringCompletion(reader, &cqe)) {
+            struct UringFile *file = &files[cqe.user_data];
+            inFlight--;
+            file->isPending = completeUringFile(reader, file, (int)cqe.user_data, cqe.res);
+            inFlight += file->isPending;
+        }
+    }
+
+    for (int i = 0; i < numFiles; i++) {
+        struct UringFile *file = &files[i];
+        if (searchOptions.useCache && file->fd != -2 && file->numMatches != -1) {
+            storeCachedResult(&file->fileStat, searchOptions.specHash, &file->record);
+        }
+        free(file->record.data);
+        appendFileResult(&file->out, file->filePath + searchOptions.rootLen, file->numMatches);
+        if (searchOptions.watchResults && file->numMatches != -1) { // search -w goes on from here when it changes
+            rememberFollowedFile(file->filePath + searchOptions.rootLen, file->fileStat.st_size);
+        }
+        if (file->numMatches > 0) {
+            atomic_store(&pool->isFound, 1);
+        }
+        writeResults(&pool->writers[workerId], &file->out);
+        free(file->filePath);
+        releaseSearchDir(file->task.dir);
+        free(file->task.name);
+    }
+    return numFiles;
+}
+
+// Main loop of a worker. It works on its own deque first and steals from the others when it is empty.
+void *searchWorker(void *param){
+    struct WorkerArg *arg = (struct WorkerArg*)param;
+    struct SearchPool *pool = arg->pool;
+    struct SearchTask task;
+    unsigned int seed = (unsigned int)arg->id * 2654435761u + 1; // every worker starts stealing from a different victim
+
+    while (1) {
+        int found = popTask(&pool->deques[arg->id], &task);
+        for (int i = 0; !found && i < pool->numWorkers; i++) { // nothing left, try to steal
+            seed = seed * 1103515245u + 12345u;
+            int victim = (int)((seed >> 16) % (unsigned int)pool->numWorkers);
+            if (victim != arg->id) {
+                found = stealTask(&pool->deques[victim], &task);
+            }
+        }
+        for (int victim = 0; !found && victim < pool->numWorkers; victim++) { // make sure every deque is tried once
+            if (victim != arg->id) {
+                found = stealTask(&pool->deques[victim], &task);
+            }
+        }
+
+        if (found) {
+            long numDone = 1;
+            if (!task.isDir && searchOptions.mode == SEARCH_MODE_SCAN && pool->readers[arg->id].ringFd != -1) {
+                numDone = runFileBatch(pool, arg->id, &task); // the files next to it are read together
+            }
+            else {
+                runTask(pool, arg->id, &task);
+            }
+            if (atomic_fetch_sub(&pool->pending, numDone) == numDone) { // it was the last task, wake up everyone to exit
+                pthread_mutex_lock(&pool->idleLock);
+                pthread_cond_broadcast(&pool->idleCond);
+                pthread_mutex_unlock(&pool->idleLock);
+            }
+            continue;
+        }
+
+        if (atomic_load(&pool->pending) == 0) { // no work anywhere, the search is finished
+            break;
+        }
+        // wait a little for new work, the timeout protects against a missed signal
+        pthread_mutex_lock(&pool->idleLock);
+        atomic_fetch_add(&pool->idleWorkers, 1);
+        if (atomic_load(&pool->pending) != 0) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += 1000000; // 1 ms
+            if (until.tv_nsec >= 1000000000) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&pool->idleCond, &pool->idleLock, &until);
+        }
+        atomic_fetch_sub(&pool->idleWorkers, 1);
+        pthread_mutex_unlock(&pool->idleLock);
+    }
+    flushResults(&pool->writers[arg->id]); // write what is left in this worker's batch
+    return NULL;
+}
+
+// This method starts the workers with the given tasks and waits until all of them finish
+int runSearch(struct SearchTask *firstTasks, int numTasks){
+    struct SearchPool pool;
+    pool.numWorkers = searchOptions.jobs;
+    pool.deques = (struct WorkDeque*)malloc(pool.numWorkers * sizeof(struct WorkDeque));
+    for (int i = 0; i < pool.numWorkers; i++) {
+        pool.deques[i].capacity = SEARCH_DEQUE_INIT;
+        pool.deques[i].tasks = (struct SearchTask*)malloc(SEARCH_DEQUE_INIT * sizeof(struct SearchTask));
+        atomic_init(&pool.deques[i].top, 0);
+        atomic_init(&pool.deques[i].bottom, 0);
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+    }
+    atomic_init(&pool.pending, 0);
+    atomic_init(&pool.idleWorkers, 0);
+    atomic_init(&pool.isFound, 0);
+    pthread_mutex_init(&pool.idleLock, NULL);
+    pthread_cond_init(&pool.idleCond, NULL);
+    pool.writers = (struct ResultWriter*)calloc(pool.numWorkers, sizeof(struct ResultWriter));
+    pool.readers = (struct UringReader*)calloc(pool.numWorkers, sizeof(struct UringReader));
+    for (int i = 0; i < pool.numWorkers; i++) { // a worker without io_uring reads with blocking calls
+        pool.readers[i].ringFd = -1;
+    }
+    for (int i = 0; searchOptions.useUring && searchOptions.mode == SEARCH_MODE_SCAN && i < pool.numWorkers; i++) {
+        if (openUringReader(&pool.readers[i]) == -1) { // io_uring is not available, all workers read with blocking calls
+            for (int j = 0; j < i; j++) {
+                closeUringReader(&pool.readers[j]);
+            }
+            break;
+        }
+    }
+
+    fflush(stdout); // anything printed before must come first
+    for (int i = numTasks - 1; i >= 0; i--) { // the first tasks are the starting directory or files
+        submitTask(&pool, 0, firstTasks[i].dir, firstTasks[i].name, firstTasks[i].isDir);
+    }
+
+    pthread_t *threads = (pthread_t*)malloc(pool.numWorkers * sizeof(pthread_t));
+    struct WorkerArg *workerArgs = (struct WorkerArg*)malloc(pool.numWorkers * sizeof(struct WorkerArg));
+    for (int i = 1; i < pool.numWorkers; i++) { // worker 0 is this thread
+        workerArgs[i].pool = &pool;
+        workerArgs[i].id = i;
+        if (pthread_create(&threads[i], NULL, searchWorker, &workerArgs[i]) != 0) {
+            fprintf(stderr, "Failed to create a search thread.\n");
+            workerArgs[i].pool = NULL;
+        }
+    }
+    workerArgs[0].pool = &pool;
+    workerArgs[0].id = 0;
+    searchWorker(&workerArgs[0]);
+    for (int i = 1; i < pool.numWorkers; i++) {
+        if (workerArgs[i].pool != NULL) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    fflush(stdout);
+
+    for (int i = 0; i < pool.numWorkers; i++) {
+        free(pool.deques[i].tasks);
+        pthread_mutex_destroy(&pool.deques[i].lock);
+    }
+    free(pool.deques);
+    free(threads);
+    free(workerArgs);
+    pthread_mutex_destroy(&pool.idleLock);
+    pthread_cond_destroy(&pool.idleCond);
+    free(pool.writers);
+    for (int i = 0; i < pool.numWorkers; i++) {
+        closeUringReader(&pool.readers[i]);
+    }
+    free(pool.readers);
+    clearVisited(); // the next search may read the same files again
+    return atomic_load(&pool.isFound);
+}
+
+// This method gives the path of a root as the root directory followed by the path from it, so the
+// printed path starts with . like the others. A path outside the current directory goes up with ..
+char *buildRootPath(const char *path){
+    size_t pathLength = strlen(path);
+    if (path[0] != '/') { // already relative to the current directory
+        char *fullPath = (char*)malloc(searchOptions.rootLen + pathLength + 2);
+        sprintf(fullPath, "%s/%s", searchOptions.rootDir, path);
+        return fullPath;
+    }
+    // find the directories both paths start with
+    size_t common = 0;
+    for (size_t i = 1; ; i++) {
+        int rootEnds = searchOptions.rootDir[i] == '\0' || searchOptions.rootDir[i] == '/';
+        int pathEnds = path[i] == '\0' || path[i] == '/';
+        if (rootEnds && pathEnds) { // a directory of both
+            common = i;
+        }
+        if (rootEnds || pathEnds) {
+            if (!(rootEnds && pathEnds) || searchOptions.rootDir[i] == '\0' || path[i] == '\0') {
+                break;
+            }
+        }
+        else if (searchOptions.rootDir[i] != path[i]) {
+            break;
+        }
+    }
+    if (searchOptions.rootLen == 1) { // the root directory is /
+        common = 0;
+    }
+    int numUps = 0; // directories of the current directory after the common part
+    for (size_t i = common; i < searchOptions.rootLen; i++) {
+        numUps += searchOptions.rootDir[i] == '/' && searchOptions.rootLen > 1;
+    }
+    char *fullPath = (char*)malloc(searchOptions.rootLen + numUps * 3 + pathLength + 2);
+    size_t length = (size_t)sprintf(fullPath, "%s", searchOptions.rootDir);
+    for (int u = 0; u < numUps; u++) {
+        length += (size_t)sprintf(fullPath + length, "/..");
+    }
+    sprintf(fullPath + length, "%s", path[common] == '\0' ? "" : path + common);
+    return fullPath;
+}
+
+// This method reads the NUL separated paths of --files-from as file tasks, returns -1 if it can not be read
+int readFileList(const char *listPath, struct SearchTask **tasks, int *numTasks, int *capacity){
+    FILE *file = fopen(listPath, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening file: %s\n", listPath);
+        return -1;
+    }
+    char *entry = NULL;
+    size_t entryCapacity = 0;
+    ssize_t length;
+    while ((length = getdelim(&entry, &entryCapacity, '\0', file)) != -1) {
+        if (length > 0 && entry[length - 1] == '\0') {
+            length--;
+        }
+        if (length == 0) {
+            continue;
+        }
+        if (*numTasks == *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 64;
+            *tasks = (struct SearchTask*)realloc(*tasks, *capacity * sizeof(struct SearchTask));
+        }
+        const char *path = entry[0] == '.' && entry[1] == '/' ? entry + 2 : entry; // ./a.c is a.c
+        (*tasks)[*numTasks].dir = NULL;
+        (*tasks)[*numTasks].name = buildRootPath(path);
+        (*tasks)[*numTasks].isDir = 0;
+        (*numTasks)++;
+    }
+    free(entry);
+    fclose(file);
+    return 0;
+}
+
+// This method searchs the roots and the listed files of the command, or the current directory if there is none.
+// The listed files are given to the workers as they are, so no directory is read for them.
+int searchFromRoots(void){
+    struct SearchTask *tasks = NULL;
+    int numTasks = 0, capacity = 0;
+    for (int r = 0; r < searchOptions.numRoots; r++) {
+        struct stat rootStat;
+        if (stat(searchOptions.roots[r], &rootStat) == -1) {
+            fprintf(stderr, "Error opening file: %s\n", searchOptions.roots[r]);
+            continue;
+        }
+        if (numTasks == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            tasks = (struct SearchTask*)realloc(tasks, capacity * sizeof(struct SearchTask));
+        }
+        tasks[numTasks].dir = NULL;
+        tasks[numTasks].name = buildRootPath(searchOptions.roots[r]);
+        tasks[numTasks].isDir = S_ISDIR(rootStat.st_mode);
+        numTasks++;
+    }
+    if (searchOptions.filesFrom != NULL && readFileList(searchOptions.filesFrom, &tasks, &numTasks, &capacity) == -1) {
+        for (int t = 0; t < numTasks; t++) {
+            free(tasks[t].name);
+        }
+        free(tasks);
+        return -1;
+    }
+    if (searchOptions.numRoots == 0 && searchOptions.filesFrom == NULL) { // the current directory
+        tasks = (struct SearchTask*)malloc(sizeof(struct SearchTask));
+        tasks[0].dir = NULL;
+        tasks[0].name = strdup(searchOptions.rootDir);
+        tasks[0].isDir = 1;
+        numTasks = 1;
+    }
+    int isFound = numTasks > 0 ? runSearch(tasks, numTasks) : 0;
+    free(tasks);
+    return isFound;
+}
+
+// ***** SEARCH INDEX *****
+// search --index build writes a trigram index of the tree to SEARCH_INDEX_NAME in the current directory.
+// search --index use only scans the files whose trigrams contain all trigrams of the keyword.
+// The file is used with mmap directly, so every part of it has a fixed layout:
+//   header | file entries | trigram entries (sorted) | posting lists | names
+// A posting list is the sorted file ids of a trigram, stored as varint coded differences.
+
+// Header at the beginning of the index file
+struct IndexHeader{
+    char magic[8]; // SEARCH_INDEX_MAGIC
+    uint32_t numFiles; // number of file entries
+    uint32_t numTrigrams; // number of trigram entries
+    uint64_t filesOffset; // where the file entries start
+    uint64_t trigramsOffset; // where the trigram entries start
+    uint64_t postingsOffset; // where the posting lists start
+    uint64_t namesOffset; // where the names start
+    uint64_t totalSize; // size of the whole file, used to detect a cut file
+};
+
+// One indexed file. Its identity and stamp are kept so that changes can be detected later.
+struct IndexFileEntry{
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint64_t size;
+    uint32_t nameOffset; // path relative to the root, starts with /
+    uint32_t nameLength;
+};
+
+// One trigram and where its posting list is
+struct IndexTrigramEntry{
+    uint32_t trigram; // three bytes, the first one is the highest
+    uint32_t count; // number of files that have it
+    uint64_t postingOffset; // relative to postingsOffset
+};
+
+// A file seen while the index is built, with its distinct trigrams in increasing order
+struct IndexedFile{
+    char *name;
+    struct stat fileStat;
+    uint32_t *trigrams;
+    uint32_t numTrigrams;
+};
+
+// Scratch space of one worker. The bitmap has a bit for every possible trigram,
+// only the bits listed in touched are set, so it is cleared quickly after every file.
+struct IndexWorker{
+    unsigned char *bitmap;
+    uint32_t *touched;
+    size_t numTouched;
+    size_t touchedCapacity;
+};
+
+// State of an index build, shared by the workers
+struct IndexBuilder{
+    struct IndexWorker *workers;
+    struct IndexedFile *files;
+    size_t numFiles;
+    size_t capacity;
+    pthread_mutex_t lock; // protects files
+};
+struct IndexBuilder indexBuilder;
+
+int compareTrigrams(const void *a, const void *b){
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+// This method reads a file and finds its distinct trigrams in increasing order, returns -1 if it can not be read
+int collectTrigrams(struct IndexWorker *worker, int dirFd, const char *name, const char *filePath, struct IndexedFile *file){
+    int fd = openat(dirFd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Error opening file: %s\n", filePath);
+        return -1;
+    }
+    if (fstat(fd, &file->fileStat) == -1) {
+        close(fd);
+        return -1;
+    }
+    worker->numTouched = 0;
+    if (file->fileStat.st_size >= 3) {
+        const unsigned char *data = (const unsigned char*)mmap(NULL, file->fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "Error reading file: %s\n", filePath);
+            close(fd);
+            return -1;
+        }
+        madvise((void*)data, file->fileStat.st_size, MADV_SEQUENTIAL);
+        uint32_t trigram = ((uint32_t)data[0] << 8) | data[1];
+        for (off_t i = 2; i < file->fileStat.st_size; i++) {
+            trigram = ((trigram << 8) | data[i]) & 0xFFFFFF;
+            if (data[i] == '\n' || data[i-1] == '\n' || data[i-2] == '\n') { // keywords never have a newline
+                continue;
+            }
+            if (!(worker->bitmap[trigram >> 3] & (1 << (trigram & 7)))) { // seen for the first time in this file
+                worker->bitmap[trigram >> 3] |= 1 << (trigram & 7);
+                if (worker->numTouched == worker->touchedCapacity) {
+                    worker->touchedCapacity = worker->touchedCapacity ? worker->touchedCapacity * 2 : 1024;
+                    worker->touched = (uint32_t*)realloc(worker->touched, worker->touchedCapacity * sizeof(uint32_t));
+                }
+                worker->touched[worker->numTouched++] = trigram;
+            }
+        }
+        munmap((void*)data, file->fileStat.st_size);
+    }
+    close(fd);
+
+    for (size_t i = 0; i < worker->numTouched; i++) { // clear only the bits we set
+        worker->bitmap[worker->touched[i] >> 3] = 0;
+    }
+    qsort(worker->touched, worker->numTouched, sizeof(uint32_t), compareTrigrams);
+    file->numTrigrams = (uint32_t)worker->numTouched;
+    file->trigrams = (uint32_t*)malloc((worker->numTouched + 1) * sizeof(uint32_t));
+    memcpy(file->trigrams, worker->touched, worker->numTouched * sizeof(uint32_t));
+    file->name = strdup(filePath + searchOptions.rootLen);
+    return 0;
+}
+
+// This method adds a file to the index that is being built
+void indexFile(int workerId, int dirFd, const char *name, const char *filePath){
+    struct IndexedFile file;
+    if (collectTrigrams(&indexBuilder.workers[workerId], dirFd, name, filePath, &file) == -1) {
+        return;
+    }
+    pthread_mutex_lock(&indexBuilder.lock);
+    if (indexBuilder.numFiles == indexBuilder.capacity) {
+        indexBuilder.capacity = indexBuilder.capacity ? indexBuilder.capacity * 2 : 256;
+        indexBuilder.files = (struct IndexedFile*)realloc(indexBuilder.files, indexBuilder.capacity * sizeof(struct IndexedFile));
+    }
+    indexBuilder.files[indexBuilder.numFiles++] = file;
+    pthread_mutex_unlock(&indexBuilder.lock);
+}
+
+// This method writes a number with 7 bits per byte, the high bit tells that more bytes follow
+size_t writeVarint(unsigned char *out, uint32_t value){
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char)value;
+    return n;
+}
+
+// This method reads a number written by writeVarint
+const unsigned char *readVarint(const unsigned char *in, uint32_t *value){
+    uint32_t result = 0;
+    int shift = 0;
+    while (*in & 0x80) {
+        result |= (uint32_t)(*in++ & 0x7F) << shift;
+        shift += 7;
+    }
+    *value = result | ((uint32_t)*in++ << shift);
+    return in;
+}
+
+int compareIndexedFiles(const void *a, const void *b){
+    return strcmp(((const struct IndexedFile*)a)->name, ((const struct IndexedFile*)b)->name);
+}
+
+// This method writes the files collected by the workers to the index file
+int writeSearchIndex(const char *indexPath){
+    size_t numFiles = indexBuilder.numFiles;
+    struct IndexedFile *files = indexBuilder.files;
+    qsort(files, numFiles, sizeof(struct IndexedFile), compareIndexedFiles); // same tree gives the same file
+
+    // count the files of every trigram, then give every used trigram its place
+    uint32_t *counts = (uint32_t*)calloc(1 << 24, sizeof(uint32_t));
+    if (counts == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return -1;
+    }
+    size_t numTrigrams = 0;
+    for (size_t f = 0; f < numFiles; f++) {
+        for (uint32_t t = 0; t < files[f].numTrigrams; t++) {
+            if (counts[files[f].trigrams[t]]++ == 0) {
+                numTrigrams++;
+            }
+        }
+    }
+    struct IndexTrigramEntry *trigrams = (struct IndexTrigramEntry*)malloc((numTrigrams + 1) * sizeof(struct IndexTrigramEntry));
+    uint32_t *slot = (uint32_t*)malloc((1 << 24) * sizeof(uint32_t)); // trigram -> its entry
+    size_t numUsed = 0;
+    for (uint32_t trigram = 0; trigram < (1 << 24); trigram++) {
+        if (counts[trigram] != 0) {
+            trigrams[numUsed].trigram = trigram;
+            trigrams[numUsed].count = counts[trigram];
+            slot[trigram] = (uint32_t)numUsed++;
+        }
+    }
+    free(counts);
+
+    // posting lists, a list never needs more than 5 bytes per file
+    uint32_t **lists = (uint32_t**)malloc((numTrigrams + 1) * sizeof(uint32_t*));
+    uint32_t *fill = (uint32_t*)calloc(numTrigrams + 1, sizeof(uint32_t));
+    for (size_t i = 0; i < numTrigrams; i++) {
+        lists[i] = (uint32_t*)malloc(trigrams[i].count * sizeof(uint32_t));
+    }
+    for (size_t f = 0; f < numFiles; f++) { // file ids are added in increasing order
+        for (uint32_t t = 0; t < files[f].numTrigrams; t++) {
+            uint32_t s = slot[files[f].trigrams[t]];
+            lists[s][fill[s]++] = (uint32_t)f;
+        }
+    }
+    free(slot);
+    free(fill);
+
+    size_t postingsSize = 0;
+    unsigned char varint[5];
+    for (size_t i = 0; i < numTrigrams; i++) {
+        trigrams[i].postingOffset = postingsSize;
+        uint32_t previous = 0;
+        for (uint32_t k = 0; k < trigrams[i].count; k++) {
+            postingsSize += writeVarint(varint, lists[i][k] - previous);
+            previous = lists[i][k];
+        }
+    }
+
+    struct IndexFileEntry *entries = (struct IndexFileEntry*)malloc((numFiles + 1) * sizeof(struct IndexFileEntry));
+    size_t namesSize = 0;
+    for (size_t f = 0; f < numFiles; f++) {
+        entries[f].dev = files[f].fileStat.st_dev;
+        entries[f].ino = files[f].fileStat.st_ino;
+        entries[f].mtimeSec = files[f].fileStat.st_mtim.tv_sec;
+        entries[f].mtimeNsec = files[f].fileStat.st_mtim.tv_nsec;
+        entries[f].size = files[f].fileStat.st_size;
+        entries[f].nameOffset = (uint32_t)namesSize;
+        entries[f].nameLength = (uint32_t)strlen(files[f].name);
+        namesSize += entries[f].nameLength + 1;
+    }
+
+    struct IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SEARCH_INDEX_MAGIC, sizeof(header.magic));
+    header.numFiles = (uint32_t)numFiles;
+    header.numTrigrams = (uint32_t)numTrigrams;
+    header.filesOffset = sizeof(header);
+    header.trigramsOffset = header.filesOffset + numFiles * sizeof(struct IndexFileEntry);
+    header.postingsOffset = header.trigramsOffset + numTrigrams * sizeof(struct IndexTrigramEntry);
+    header.namesOffset = header.postingsOffset + postingsSize;
+    header.totalSize = header.namesOffset + namesSize;
+
+    // write to a temporary file first, so a search never sees a half written index
+    char tempPath[PATH_MAX + 8];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", indexPath);
+    FILE *out = fopen(tempPath, "w");
+    int result = 0;
+    if (out == NULL) {
+        fprintf(stderr, "Failed to open file.\n");
+        result = -1;
+    }
+    else {
+        fwrite(&header, sizeof(header), 1, out);
+        fwrite(entries, sizeof(struct IndexFileEntry), numFiles, out);
+        fwrite(trigrams, sizeof(struct IndexTrigramEntry), numTrigrams, out);
+        for (size_t i = 0; i < numTrigrams; i++) {
+            uint32_t previous = 0;
+            for (uint32_t k = 0; k < trigrams[i].count; k++) {
+                fwrite(varint, 1, writeVarint(varint, lists[i][k] - previous), out);
+                previous = lists[i][k];
+            }
+        }
+        for (size_t f = 0; f < numFiles; f++) {
+            fwrite(files[f].name, 1, entries[f].nameLength + 1, out);
+        }
+        if (fclose(out) != 0 || rename(tempPath, indexPath) == -1) {
+            fprintf(stderr, "Failed to write the index.\n");
+            unlink(tempPath);
+            result = -1;
+        }
+    }
+    if (result == 0) {
+        printf("Index built: %zu files, %zu trigrams.\n", numFiles, numTrigrams);
+    }
+
+    for (size_t i = 0; i < numTrigrams; i++) {
+        free(lists[i]);
+    }
+    free(lists);
+    free(trigrams);
+    free(entries);
+    return result;
+}
+
+// This method walks the whole tree with the search workers and writes its index
+int buildSearchIndex(void){
+    indexBuilder.files = NULL;
+    indexBuilder.numFiles = 0;
+    indexBuilder.capacity = 0;
+    pthread_mutex_init(&indexBuilder.lock, NULL);
+    indexBuilder.workers = (struct IndexWorker*)calloc(searchOptions.jobs, sizeof(struct IndexWorker));
+    for (int i = 0; i < searchOptions.jobs; i++) {
+        indexBuilder.workers[i].bitmap = (unsigned char*)calloc((1 << 24) / 8, 1);
+    }
+
+    searchOptions.recursive = 1; // the index always covers the whole tree
+    struct SearchTask root = {NULL, strdup(searchOptions.rootDir), 1};
+    runSearch(&root, 1);
+
+    char indexPath[PATH_MAX + sizeof(SEARCH_INDEX_NAME) + 1];
+    snprintf(indexPath, sizeof(indexPath), "%s/%s", searchOptions.rootDir, SEARCH_INDEX_NAME);
+    int result = writeSearchIndex(indexPath);
+
+    for (int i = 0; i < searchOptions.jobs; i++) {
+        free(indexBuilder.workers[i].bitmap);
+        free(indexBuilder.workers[i].touched);
+    }
+    free(indexBuilder.workers);
+    for (size_t f = 0; f < indexBuilder.numFiles; f++) {
+        free(indexBuilder.files[f].name);
+        free(indexBuilder.files[f].trigrams);
+    }
+    free(indexBuilder.files);
+    pthread_mutex_destroy(&indexBuilder.lock);
+    return result;
+}
+
+// This method finds the posting list of a trigram with binary search, returns NULL if no file has it
+const struct IndexTrigramEntry *findTrigram(const struct IndexTrigramEntry *trigrams, uint32_t numTrigrams, uint32_t trigram){
+    uint32_t low = 0, high = numTrigrams;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (trigrams[middle].trigram < trigram) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return (low < numTrigrams && trigrams[low].trigram == trigram) ? &trigrams[low] : NULL;
+}
+
+// This method opens the index of the current directory and checks it, returns NULL if there is no valid index
+const struct IndexHeader *openSearchIndex(size_t *mappedSize){
+    char indexPath[PATH_MAX + sizeof(SEARCH_INDEX_NAME) + 1];
+    snprintf(indexPath, sizeof(indexPath), "%s/%s", searchOptions.rootDir, SEARCH_INDEX_NAME);
+    int fd = open(indexPath, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "No search index found, run search --index build first.\n");
+        return NULL;
+    }
+    struct stat indexStat;
+    void *mapped = MAP_FAILED;
+    if (fstat(fd, &indexStat) == 0 && indexStat.st_size >= (off_t)sizeof(struct IndexHeader)) {
+        mapped = mmap(NULL, indexStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        fprintf(stderr, "Error reading the search index.\n");
+        return NULL;
+    }
+    const struct IndexHeader *header = (const struct IndexHeader*)mapped;
+    if (memcmp(header->magic, SEARCH_INDEX_MAGIC, sizeof(header->magic)) != 0 || header->totalSize != (uint64_t)indexStat.st_size) {
+        fprintf(stderr, "The search index is not valid, run search --index build again.\n");
+        munmap(mapped, indexStat.st_size);
+        return NULL;
+    }
+    *mappedSize = indexStat.st_size;
+    return header;
+}
+
+// ***** INDEX WATCHER *****
+// search --index watch keeps the index of the current directory up to date while the shell runs.
+// The index file itself is not rewritten. Files that changed since it was built are kept in an
+// overlay in memory, keyed by their relative path, and searchWithIndex uses the overlay entry
+// instead of the one in the file. Events are read at every prompt, so only changed files are read.
+
+// A file whose state is different from the index file
+struct IndexOverlayEntry{
+    char *name; // path relative to the root, starts with /
+    int isDeleted; // 1 if the file is gone or is not searched any more
+    struct IndexedFile file; // its stamp and trigrams when it is not deleted
+    struct IndexOverlayEntry *next; // next entry in the same bucket
+};
+
+// State of the watcher, inotifyFd is -1 when nothing is watched
+struct IndexWatch{
+    int inotifyFd;
+    char rootDir[PATH_MAX]; // the directory whose index is watched
+    const struct IndexHeader *header; // the index file, mapped
+    size_t mappedSize;
+    struct IndexOverlayEntry **buckets; // hash table of the overlay
+    size_t numBuckets;
+    size_t numEntries;
+    char **watchDirs; // relative path of every watch descriptor, "" is the root
+    int watchCapacity;
+    int numWatches;
+    unsigned char *seen; // files of the index file that are found by the first walk
+    struct IndexWorker worker; // scratch space for reading changed files
+    struct TypeFilter types; // the search types when the index was built or watched, later searches do not change them
+    pthread_mutex_t lock; // the first walk runs on the search workers
+};
+struct IndexWatch indexWatch = {.inotifyFd = -1};
+
+// FNV-1a hash of a relative path
+size_t hashName(const char *name){
+    size_t hash = 14695981039346656037ULL;
+    while (*name) {
+        hash = (hash ^ (unsigned char)*name++) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// This method finds the overlay entry of a file, returns NULL if the index file is still right about it
+struct IndexOverlayEntry *findOverlayEntry(const char *name){
+    struct IndexOverlayEntry *entry = indexWatch.buckets[hashName(name) & (indexWatch.numBuckets - 1)];
+    while (entry != NULL && strcmp(entry->name, name) != 0) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+// This method gives the overlay entry of a file, it is created if it does not exist
+struct IndexOverlayEntry *getOverlayEntry(const char *name){
+    struct IndexOverlayEntry *entry = findOverlayEntry(name);
+    if (entry != NULL) {
+        if (!entry->isDeleted) { // the old trigrams are replaced by the caller
+            free(entry->file.trigrams);
+            free(entry->file.name);
+        }
+        return entry;
+    }
+    if (indexWatch.numEntries >= indexWatch.numBuckets) { // keep the table at most full, double it
+        size_t newNumBuckets = indexWatch.numBuckets * 2;
+        struct IndexOverlayEntry **newBuckets = (struct IndexOverlayEntry**)calloc(newNumBuckets, sizeof(struct IndexOverlayEntry*));
+        for (size_t b = 0; b < indexWatch.numBuckets; b++) {
+            while (indexWatch.buckets[b] != NULL) {
+                struct IndexOverlayEntry *moved = indexWatch.buckets[b];
+                indexWatch.buckets[b] = moved->next;
+                size_t slot = hashName(moved->name) & (newNumBuckets - 1);
+                moved->next = newBuckets[slot];
+                newBuckets[slot] = moved;
+            }
+        }
+        free(indexWatch.buckets);
+        indexWatch.buckets = newBuckets;
+        indexWatch.numBuckets = newNumBuckets;
+    }
+    entry = (struct IndexOverlayEntry*)calloc(1, sizeof(struct IndexOverlayEntry));
+    entry->name = strdup(name);
+    entry->isDeleted = 1;
+    size_t slot = hashName(name) & (indexWatch.numBuckets - 1);
+    entry->next = indexWatch.buckets[slot];
+    indexWatch.buckets[slot] = entry;
+    indexWatch.numEntries++;
+    return entry;
+}
+
+// This method frees every overlay entry
+void clearIndexOverlay(void){
+    for (size_t b = 0; b < indexWatch.numBuckets; b++) {
+        while (indexWatch.buckets[b] != NULL) {
+            struct IndexOverlayEntry *entry = indexWatch.buckets[b];
+            indexWatch.buckets[b] = entry->next;
+            if (!entry->isDeleted) {
+                free(entry->file.trigrams);
+                free(entry->file.name);
+            }
+            free(entry->name);
+            free(entry);
+        }
+    }
+    indexWatch.numEntries = 0;
+}
+
+// This method finds a file of the index file by its name, the names are sorted so binary search is used.
+// It returns the first file that is not smaller than name, so it also gives where a prefix starts.
+uint32_t findIndexFile(const char *name){
+    const char *base = (const char*)indexWatch.header;
+    const struct IndexFileEntry *entries = (const struct IndexFileEntry*)(base + indexWatch.header->filesOffset);
+    const char *names = base + indexWatch.header->namesOffset;
+    uint32_t low = 0, high = indexWatch.header->numFiles;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (strcmp(names + entries[middle].nameOffset, name) < 0) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// This method checks whether a file still has the inode and modification time it was indexed with
+int hasSameStamp(const struct stat *fileStat, uint64_t dev, uint64_t ino, int64_t mtimeSec, int64_t mtimeNsec, uint64_t size){
+    return fileStat->st_dev == dev && fileStat->st_ino == ino && fileStat->st_mtim.tv_sec == mtimeSec
+        && fileStat->st_mtim.tv_nsec == mtimeNsec && (uint64_t)fileStat->st_size == size;
+}
+
+// This method brings the index up to date for one file. The file is only read again
+// when its inode or modification time is different from what the index knows.
+void updateIndexEntry(const char *name){
+    char fullPath[PATH_MAX * 2];
+    snprintf(fullPath, sizeof(fullPath), "%s%s", indexWatch.rootDir, name);
+    struct stat fileStat;
+    const char *baseName = strrchr(name, '/');
+    int isPresent = lstat(fullPath, &fileStat) == 0 && S_ISREG(fileStat.st_mode) && hasSearchExtension(&indexWatch.types, baseName ? baseName + 1 : name);
+
+    pthread_mutex_lock(&indexWatch.lock);
+    const struct IndexFileEntry *entries = (const struct IndexFileEntry*)((const char*)indexWatch.header + indexWatch.header->filesOffset);
+    const char *names = (const char*)indexWatch.header + indexWatch.header->namesOffset;
+    uint32_t fileId = findIndexFile(name);
+    const struct IndexFileEntry *indexed = NULL;
+    if (fileId < indexWatch.header->numFiles && strcmp(names + entries[fileId].nameOffset, name) == 0) {
+        indexed = &entries[fileId];
+        if (indexWatch.seen != NULL) {
+            indexWatch.seen[fileId] = 1;
+        }
+    }
+    struct IndexOverlayEntry *overlay = findOverlayEntry(name);
+
+    if (!isPresent) { // deleted, moved away or not searchable any more
+        if (indexed != NULL || overlay != NULL) {
+            overlay = getOverlayEntry(name);
+            overlay->isDeleted = 1;
+        }
+    }
+    else if (overlay != NULL && !overlay->isDeleted) { // compare with the newer state in the overlay
+        const struct stat *known = &overlay->file.fileStat;
+        if (!hasSameStamp(&fileStat, known->st_dev, known->st_ino, known->st_mtim.tv_sec, known->st_mtim.tv_nsec, known->st_size)) {
+            struct IndexedFile file;
+            if (collectTrigrams(&indexWatch.worker, AT_FDCWD, fullPath, fullPath, &file) == 0) {
+                overlay = getOverlayEntry(name);
+                overlay->file = file;
+            }
+        }
+    }
+    else if (overlay != NULL || indexed == NULL
+             || !hasSameStamp(&fileStat, indexed->dev, indexed->ino, indexed->mtimeSec, indexed->mtimeNsec, indexed->size)) {
+        struct IndexedFile file;
+        if (collectTrigrams(&indexWatch.worker, AT_FDCWD, fullPath, fullPath, &file) == 0) {
+            overlay = getOverlayEntry(name);
+            overlay->file = file;
+            overlay->isDeleted = 0;
+        }
+    }
+    pthread_mutex_unlock(&indexWatch.lock);
+}
+
+// This method adds an inotify watch for a directory of the watched tree
+void watchIndexDirectory(const char *dirPath){
+    int wd = inotify_add_watch(indexWatch.inotifyFd, dirPath, INDEX_WATCH_MASK);
+    if (wd == -1) {
+        fprintf(stderr, "Failed to watch directory: %s\n", dirPath);
+        return;
+    }
+    pthread_mutex_lock(&indexWatch.lock);
+    if (wd >= indexWatch.watchCapacity) {
+        int newCapacity = indexWatch.watchCapacity ? indexWatch.watchCapacity : 64;
+        while (newCapacity <= wd) {
+            newCapacity *= 2;
+        }
+        indexWatch.watchDirs = (char**)realloc(indexWatch.watchDirs, newCapacity * sizeof(char*));
+        memset(indexWatch.watchDirs + indexWatch.watchCapacity, 0, (newCapacity - indexWatch.watchCapacity) * sizeof(char*));
+        indexWatch.watchCapacity = newCapacity;
+    }
+    if (indexWatch.watchDirs[wd] == NULL) {
+        indexWatch.numWatches++;
+    }
+    free(indexWatch.watchDirs[wd]); // the same directory can be added again after a move
+    indexWatch.watchDirs[wd] = strdup(dirPath + strlen(indexWatch.rootDir));
+    pthread_mutex_unlock(&indexWatch.lock);
+}
+
+// This method walks a directory of the watched tree with the search workers, every directory
+// gets a watch and every file is compared with the index. The search options are kept as they were.
+void syncIndexTree(const char *dirPath){
+    struct SearchOptions saved = searchOptions;
+    searchOptions.mode = SEARCH_MODE_SYNC_INDEX;
+    searchOptions.recursive = 1;
+    if (searchOptions.jobs < 1) {
+        searchOptions.jobs = 1;
+    }
+    strcpy(searchOptions.rootDir, indexWatch.rootDir);
+    searchOptions.rootLen = strlen(indexWatch.rootDir);
+    searchOptions.types = &indexWatch.types;
+    struct SearchTask root = {NULL, strdup(dirPath), 1};
+    runSearch(&root, 1);
+    searchOptions = saved;
+}
+
+// This method marks every file under a directory that is deleted or moved away, and removes its watches
+void removeIndexTree(const char *name){
+    char prefix[PATH_MAX];
+    snprintf(prefix, sizeof(prefix), "%s/", name);
+    size_t prefixLen = strlen(prefix);
+
+    const struct IndexFileEntry *entries = (const struct IndexFileEntry*)((const char*)indexWatch.header + indexWatch.header->filesOffset);
+    const char *names = (const char*)indexWatch.header + indexWatch.header->namesOffset;
+    for (uint32_t f = findIndexFile(prefix); f < indexWatch.header->numFiles; f++) { // the files under it are next to each other
+        const char *fileName = names + entries[f].nameOffset;
+        if (strncmp(fileName, prefix, prefixLen) != 0) {
+            break;
+        }
+        struct IndexOverlayEntry *overlay = getOverlayEntry(fileName);
+        overlay->isDeleted = 1;
+    }
+    for (size_t b = 0; b < indexWatch.numBuckets; b++) { // files that were added after the index was built
+        for (struct IndexOverlayEntry *entry = indexWatch.buckets[b]; entry != NULL; entry = entry->next) {
+            if (!entry->isDeleted && strncmp(entry->name, prefix, prefixLen) == 0) {
+                free(entry->file.trigrams);
+                free(entry->file.name);
+                entry->isDeleted = 1;
+            }
+        }
+    }
+    for (int wd = 0; wd < indexWatch.watchCapacity; wd++) {
+        if (indexWatch.watchDirs[wd] != NULL && (strcmp(indexWatch.watchDirs[wd], name) == 0 || strncmp(indexWatch.watchDirs[wd], prefix, prefixLen) == 0)) {
+            inotify_rm_watch(indexWatch.inotifyFd, wd);
+            free(indexWatch.watchDirs[wd]);
+            indexWatch.watchDirs[wd] = NULL;
+            indexWatch.numWatches--;
+        }
+    }
+}
+
+// This method reads the waiting inotify events and updates the index for the files they name.
+// It never blocks, when nothing changed it costs a single read.
+void processIndexEvents(void){
+    if (indexWatch.inotifyFd == -1) {
+        return;
+    }
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int overflow = 0;
+    ssize_t length;
+    while ((length = read(indexWatch.inotifyFd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + length; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            const struct inotify_event *event = (const struct inotify_event*)p;
+            if (event->mask & IN_Q_OVERFLOW) { // events are lost, compare the whole tree again
+                overflow = 1;
+                continue;
+            }
+            if (event->mask & IN_IGNORED) { // the watch is removed by the kernel
+                if (event->wd < indexWatch.watchCapacity && indexWatch.watchDirs[event->wd] != NULL) {
+                    free(indexWatch.watchDirs[event->wd]);
+                    indexWatch.watchDirs[event->wd] = NULL;
+                    indexWatch.numWatches--;
+                }
+                continue;
+            }
+            if (event->len == 0 || event->wd >= indexWatch.watchCapacity || indexWatch.watchDirs[event->wd] == NULL) {
+                continue;
+            }
+            char name[PATH_MAX];
+            snprintf(name, sizeof(name), "%s/%s", indexWatch.watchDirs[event->wd], event->name);
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    removeIndexTree(name);
+                }
+                else if (event->mask & (IN_CREATE | IN_MOVED_TO)) { // the files in it are new
+                    char fullPath[PATH_MAX * 2];
+                    snprintf(fullPath, sizeof(fullPath), "%s%s", indexWatch.rootDir, name);
+                    syncIndexTree(fullPath);
+                }
+            }
+            else {
+                updateIndexEntry(name);
+            }
+        }
+    }
+    if (overflow) {
+        syncIndexTree(indexWatch.rootDir);
+    }
+}
+
+// This method maps the index of the watched directory, returns -1 if there is no valid index
+int loadWatchedIndex(void){
+    struct SearchOptions saved = searchOptions;
+    strcpy(searchOptions.rootDir, indexWatch.rootDir);
+    indexWatch.header = openSearchIndex(&indexWatch.mappedSize);
+    searchOptions = saved;
+    return indexWatch.header == NULL ? -1 : 0;
+}
+
+// This method stops watching and frees everything the watcher has
+void stopIndexWatch(void){
+    if (indexWatch.inotifyFd == -1) {
+        return;
+    }
+    close(indexWatch.inotifyFd); // this also removes every watch
+    indexWatch.inotifyFd = -1;
+    clearIndexOverlay();
+    free(indexWatch.buckets);
+    indexWatch.buckets = NULL;
+    for (int wd = 0; wd < indexWatch.watchCapacity; wd++) {
+        free(indexWatch.watchDirs[wd]);
+    }
+    free(indexWatch.watchDirs);
+    indexWatch.watchDirs = NULL;
+    indexWatch.watchCapacity = 0;
+    indexWatch.numWatches = 0;
+    munmap((void*)indexWatch.header, indexWatch.mappedSize);
+    free(indexWatch.worker.bitmap);
+    free(indexWatch.worker.touched);
+    memset(&indexWatch.worker, 0, sizeof(indexWatch.worker));
+    clearSearchTypes(&indexWatch.types);
+    pthread_mutex_destroy(&indexWatch.lock);
+}
+
+// This method starts watching the index of the current directory. The tree is compared with the
+// index once, by inode and modification time, so changes made while the shell was closed are seen too.
+int startIndexWatch(void){
+    stopIndexWatch(); // only one tree is watched at a time
+    strcpy(indexWatch.rootDir, searchOptions.rootDir);
+    if (loadWatchedIndex() == -1) {
+        return -1;
+    }
+    indexWatch.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (indexWatch.inotifyFd == -1) {
+        fprintf(stderr, "Failed to start inotify.\n");
+        munmap((void*)indexWatch.header, indexWatch.mappedSize);
+        return -1;
+    }
+    pthread_mutex_init(&indexWatch.lock, NULL);
+    indexWatch.numBuckets = 256;
+    indexWatch.buckets = (struct IndexOverlayEntry**)calloc(indexWatch.numBuckets, sizeof(struct IndexOverlayEntry*));
+    indexWatch.worker.bitmap = (unsigned char*)calloc((1 << 24) / 8, 1);
+
+    indexWatch.seen = (unsigned char*)calloc(indexWatch.header->numFiles + 1, 1);
+    copySearchTypes(&indexWatch.types, &searchTypes); // the files of these types are kept up to date
+    syncIndexTree(indexWatch.rootDir);
+    const char *names = (const char*)indexWatch.header + indexWatch.header->namesOffset;
+    const struct IndexFileEntry *entries = (const struct IndexFileEntry*)((const char*)indexWatch.header + indexWatch.header->filesOffset);
+    for (uint32_t f = 0; f < indexWatch.header->numFiles; f++) { // files of the index that are not in the tree any more
+        if (!indexWatch.seen[f]) {
+            getOverlayEntry(names + entries[f].nameOffset)->isDeleted = 1;
+        }
+    }
+    free(indexWatch.seen);
+    indexWatch.seen = NULL;
+    printf("Watching %d directories, %zu files changed since the index was built.\n", indexWatch.numWatches, indexWatch.numEntries);
+    return 0;
+}
+
+// This method is called after the index of the watched directory is built again, the overlay is not needed any more
+void reloadIndexWatch(void){
+    if (indexWatch.inotifyFd == -1 || strcmp(indexWatch.rootDir, searchOptions.rootDir) != 0) {
+        return;
+    }
+    munmap((void*)indexWatch.header, indexWatch.mappedSize);
+    clearIndexOverlay();
+    clearSearchTypes(&indexWatch.types); // the new index has the types of this search
+    copySearchTypes(&indexWatch.types, &searchTypes);
+    if (loadWatchedIndex() == -1) {
+        stopIndexWatch();
+    }
+}
+
+// This method gives the trigrams a file may have for the three bytes of a keyword. It is the trigram
+// itself, or with -i every mix of the cases of its letters. Returns how many there are, at most 8.
+int trigramVariants(const unsigned char *bytes, uint32_t *variants){
+    int numVariants = 0;
+    for (int v = 0; v < (searchOptions.ignoreCase ? 8 : 1); v++) {
+        uint32_t trigram = 0;
+        int isDuplicate = 0;
+        for (int b = 0; b < 3; b++) {
+            unsigned char lower = searchOptions.ignoreCase ? foldTable[bytes[b]] : bytes[b];
+            int isLetter = lower >= 'a' && lower <= 'z';
+            if ((v >> b) & 1) { // the upper case at this place
+                isDuplicate |= !isLetter;
+                lower = (unsigned char)(lower - ('a' - 'A'));
+            }
+            trigram = (trigram << 8) | lower;
+        }
+        if (!isDuplicate) { // a byte that is not a letter has only one case
+            variants[numVariants++] = trigram;
+        }
+    }
+    return numVariants;
+}
+
+// This method finds the files of the index that have every trigram of the keyword, they are written to
+// candidates in increasing order. Keywords shorter than three bytes have no trigrams, then all files are given.
+uint32_t narrowByKeyword(const struct IndexHeader *header, const char *keywordText, uint32_t *candidates){
+    const char *base = (const char*)header;
+    const struct IndexTrigramEntry *trigrams = (const struct IndexTrigramEntry*)(base + header->trigramsOffset);
+    const unsigned char *postings = (const unsigned char*)(base + header->postingsOffset);
+
+    // candidates start as every file and get smaller with each trigram of the keyword
+    uint32_t numCandidates = header->numFiles;
+    for (uint32_t f = 0; f < header->numFiles; f++) {
+        candidates[f] = f;
+    }
+    const unsigned char *keyword = (const unsigned char*)keywordText;
+    size_t keywordLen = strlen(keywordText);
+    unsigned char *isListed = (unsigned char*)calloc(header->numFiles, 1); // files in the posting lists of this trigram
+    for (size_t i = 0; i + 2 < keywordLen && numCandidates > 0; i++) {
+        // with -i every case of the trigram is looked up, a file is kept if it has any of them
+        uint32_t variants[8];
+        int numVariants = trigramVariants(keyword + i, variants), isFound = 0;
+        for (int v = 0; v < numVariants; v++) {
+            const struct IndexTrigramEntry *entry = findTrigram(trigrams, header->numTrigrams, variants[v]);
+            if (entry == NULL) {
+                continue;
+            }
+            isFound = 1;
+            const unsigned char *p = postings + entry->postingOffset;
+            uint32_t fileId = 0;
+            for (uint32_t k = 0; k < entry->count; k++) {
+                uint32_t delta;
+                p = readVarint(p, &delta);
+                fileId += delta;
+                isListed[fileId] = 1;
+            }
+        }
+        if (!isFound) { // no file has it, so no file has the keyword
+            numCandidates = 0;
+            break;
+        }
+        // keep the candidates that are listed, and clear the marks for the next trigram
+        uint32_t kept = 0;
+        for (uint32_t c = 0; c < numCandidates; c++) {
+            if (isListed[candidates[c]]) {
+                candidates[kept++] = candidates[c];
+            }
+        }
+        numCandidates = kept;
+        memset(isListed, 0, header->numFiles);
+    }
+    free(isListed);
+    return numCandidates;
+}
+
+// This method finds the files that may have one of the keywords and searchs only them.
+int searchWithIndex(void){
+    size_t mappedSize;
+    const struct IndexHeader *header = openSearchIndex(&mappedSize);
+    if (header == NULL) {
+        return -1;
+    }
+    const char *base = (const char*)header;
+    const struct IndexFileEntry *entries = (const struct IndexFileEntry*)(base + header->filesOffset);
+    const char *names = base + header->namesOffset;
+    int useOverlay = indexWatch.inotifyFd != -1 && strcmp(indexWatch.rootDir, searchOptions.rootDir) == 0;
+    if (useOverlay) {
+        processIndexEvents(); // catch the changes made since the last prompt
+    }
+
+    // a file is a candidate if it has every trigram of at least one keyword
+    unsigned char *selected = (unsigned char*)calloc(header->numFiles + 1, 1);
+    uint32_t *candidates = (uint32_t*)malloc((header->numFiles + 1) * sizeof(uint32_t));
+    for (int k = 0; k < searchOptions.numKeywords; k++) {
+        uint32_t numCandidates = narrowByKeyword(header, searchOptions.keywords[k], candidates);
+        for (uint32_t c = 0; c < numCandidates; c++) {
+            selected[candidates[c]] = 1;
+        }
+    }
+    free(candidates);
+
+    // the candidates are searched as usual, the line scan drops the ones that do not really match
+    struct SearchTask *tasks = (struct SearchTask*)malloc((header->numFiles + 1) * sizeof(struct SearchTask));
+    int numTasks = 0;
+    for (uint32_t f = 0; f < header->numFiles; f++) {
+        if (!selected[f]) {
+            continue;
+        }
+        const char *name = names + entries[f].nameOffset;
+        if (!searchOptions.recursive && strchr(name + 1, '/') != NULL) { // without -r only the current directory
+            continue;
+        }
+        if (useOverlay && findOverlayEntry(name) != NULL) { // the file changed, the overlay knows it better
+            continue;
+        }
+        tasks[numTasks].dir = NULL;
+        tasks[numTasks].name = (char*)malloc(searchOptions.rootLen + entries[f].nameLength + 1);
+        strcpy(tasks[numTasks].name, searchOptions.rootDir);
+        strcat(tasks[numTasks].name, name);
+        tasks[numTasks].isDir = 0;
+        numTasks++;
+    }
+    munmap((void*)header, mappedSize);
+    free(selected);
+
+    // files that changed since the index was built are checked against their trigrams in the overlay
+    for (size_t b = 0; useOverlay && b < indexWatch.numBuckets; b++) {
+        for (struct IndexOverlayEntry *entry = indexWatch.buckets[b]; entry != NULL; entry = entry->next) {
+            if (entry->isDeleted || (!searchOptions.recursive && strchr(entry->name + 1, '/') != NULL)) {
+                continue;
+            }
+            int hasAll = 0;
+            for (int k = 0; k < searchOptions.numKeywords && !hasAll; k++) {
+                const unsigned char *keyword = (const unsigned char*)searchOptions.keywords[k];
+                size_t keywordLen = strlen(searchOptions.keywords[k]);
+                hasAll = 1;
+                for (size_t i = 0; i + 2 < keywordLen && hasAll; i++) {
+                    uint32_t variants[8]; // with -i any case of the trigram is enough, like in narrowByKeyword
+                    int numVariants = trigramVariants(keyword + i, variants);
+                    hasAll = 0;
+                    for (int v = 0; v < numVariants && !hasAll; v++) {
+                        hasAll = bsearch(&variants[v], entry->file.trigrams, entry->file.numTrigrams, sizeof(uint32_t), compareTrigrams) != NULL;
+                    }
+                }
+            }
+            if (!hasAll) {
+                continue;
+            }
+            tasks = (struct SearchTask*)realloc(tasks, (numTasks + 1) * sizeof(struct SearchTask)); // make room for it
+            tasks[numTasks].dir = NULL;
+            tasks[numTasks].name = (char*)malloc(searchOptions.rootLen + strlen(entry->name) + 1);
+            strcpy(tasks[numTasks].name, searchOptions.rootDir);
+            strcat(tasks[numTasks].name, entry->name);
+            tasks[numTasks].isDir = 0;
+            numTasks++;
+        }
+    }
+
+    int isFound = numTasks > 0 ? runSearch(tasks, numTasks) : 0;
+    free(tasks);
+    return isFound;
+}
+
+// ***** LIVE RESULTS *****
+// search -w does the normal search first and then keeps watching the tree with inotify. Every file
+// remembers how far it is searched, so a change only costs a search of the lines added after that
+// point, and new matches are printed as soon as they are written. A file that gets shorter is
+// rewritten, so it is searched again from the beginning. Pressing Enter stops the watch.
+
+// A file followed by search -w
+struct FollowedFile{
+    char *name; // path relative to the root, starts with /
+    off_t offset; // bytes that are searched
+    int lineNumber; // line number at offset, 0 until the file changes for the first time
+    struct FollowedFile *next; // next file in the same bucket
+};
+
+// State of search -w, inotifyFd is -1 when nothing is followed
+struct ResultWatch{
+    int inotifyFd;
+    char **watchDirs; // relative path of every watch descriptor, "" is the root
+    struct IgnoreList **watchIgnores; // ignore rules of every watched directory, the ones the first search used
+    int watchCapacity;
+    struct FollowedFile **buckets; // hash table of the files
+    size_t numBuckets;
+    size_t numFiles;
+    pthread_mutex_t lock; // the first search runs on the search workers
+};
+struct ResultWatch resultWatch = {.inotifyFd = -1};
+
+// This method adds an inotify watch for a directory of the followed tree, returns the watch descriptor or -1
+int followDirectory(const char *dirPath){
+    int wd = inotify_add_watch(resultWatch.inotifyFd, dirPath, RESULT_WATCH_MASK);
+    if (wd == -1) {
+        fprintf(stderr, "Failed to watch directory: %s\n", dirPath);
+        return -1;
+    }
+    pthread_mutex_lock(&resultWatch.lock);
+    if (wd >= resultWatch.watchCapacity) {
+        int newCapacity = resultWatch.watchCapacity ? resultWatch.watchCapacity : 64;
+        while (newCapacity <= wd) {
+            newCapacity *= 2;
+        }
+        resultWatch.watchDirs = (char**)realloc(resultWatch.watchDirs, newCapacity * sizeof(char*));
+        memset(resultWatch.watchDirs + resultWatch.watchCapacity, 0, (newCapacity - resultWatch.watchCapacity) * sizeof(char*));
+        resultWatch.watchIgnores = (struct IgnoreList**)realloc(resultWatch.watchIgnores, newCapacity * sizeof(struct IgnoreList*));
+        memset(resultWatch.watchIgnores + resultWatch.watchCapacity, 0, (newCapacity - resultWatch.watchCapacity) * sizeof(struct IgnoreList*));
+        resultWatch.watchCapacity = newCapacity;
+    }
+    free(resultWatch.watchDirs[wd]); // the same directory can be added again after a move
+    resultWatch.watchDirs[wd] = strdup(dirPath + searchOptions.rootLen);
+    pthread_mutex_unlock(&resultWatch.lock);
+    return wd;
+}
+
+// This method keeps the ignore rules of a watched directory, the directory of the search shares them
+void setFollowedIgnores(int wd, struct IgnoreList *ignore){
+    if (ignore != NULL) {
+        atomic_fetch_add(&ignore->refs, 1);
+    }
+    pthread_mutex_lock(&resultWatch.lock);
+    releaseIgnoreList(resultWatch.watchIgnores[wd]);
+    resultWatch.watchIgnores[wd] = ignore;
+    pthread_mutex_unlock(&resultWatch.lock);
+}
+
+// This method searchs a directory that appears in a followed directory. It is read like a child of
+// that directory, so the ignore rules and the depth of the first search apply to it.
+void searchFollowedDirectory(int wd, const char *name){
+    int depth = 0;
+    for (const char *p = resultWatch.watchDirs[wd]; *p; p++) { // "/a/b" is two below the root
+        depth += *p == '/';
+    }
+    if (!searchOptions.recursive || (searchOptions.maxDepth >= 0 && depth + 1 >= searchOptions.maxDepth)) { // the first search did not go there either
+        return;
+    }
+    char parentPath[PATH_MAX * 2];
+    snprintf(parentPath, sizeof(parentPath), "%s%s", searchOptions.rootDir, resultWatch.watchDirs[wd]);
+    int parentFd = open(parentPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (parentFd == -1) { // it is already gone
+        return;
+    }
+    struct SearchDir *parent = (struct SearchDir*)malloc(sizeof(struct SearchDir));
+    parent->fd = parentFd;
+    atomic_init(&parent->refs, 1); // the task gives it up when it is done
+    parent->path = strdup(parentPath);
+    parent->pathLength = strlen(parentPath);
+    parent->ignore = resultWatch.watchIgnores[wd];
+    if (parent->ignore != NULL) {
+        atomic_fetch_add(&parent->ignore->refs, 1);
+    }
+    parent->depth = depth;
+    struct SearchTask task = {parent, strdup(name), 1};
+    runSearch(&task, 1);
+}
+
+// This method finds a followed file, it is added with offset 0 if it is new. The lock must be held.
+struct FollowedFile *getFollowedFile(const char *name){
+    if (resultWatch.numFiles >= resultWatch.numBuckets) { // grow the table
+        size_t newNumBuckets = resultWatch.numBuckets ? resultWatch.numBuckets * 2 : 1024;
+        struct FollowedFile **newBuckets = (struct FollowedFile**)calloc(newNumBuckets, sizeof(struct FollowedFile*));
+        for (size_t b = 0; b < resultWatch.numBuckets; b++) {
+            while (resultWatch.buckets[b] != NULL) {
+                struct FollowedFile *moved = resultWatch.buckets[b];
+                resultWatch.buckets[b] = moved->next;
+                size_t slot = hashName(moved->name) & (newNumBuckets - 1);
+                moved->next = newBuckets[slot];
+                newBuckets[slot] = moved;
+            }
+        }
+        free(resultWatch.buckets);
+        resultWatch.buckets = newBuckets;
+        resultWatch.numBuckets = newNumBuckets;
+    }
+    size_t slot = hashName(name) & (resultWatch.numBuckets - 1);
+    for (struct FollowedFile *file = resultWatch.buckets[slot]; file != NULL; file = file->next) {
+        if (!strcmp(file->name, name)) {
+            return file;
+        }
+    }
+    struct FollowedFile *file = (struct FollowedFile*)calloc(1, sizeof(struct FollowedFile));
+    file->name = strdup(name);
+    file->lineNumber = 1;
+    file->next = resultWatch.buckets[slot];
+    resultWatch.buckets[slot] = file;
+    resultWatch.numFiles++;
+    return file;
+}
+
+// This method remembers the size of a file the first search has read, name is relative to the root
+void rememberFollowedFile(const char *name, off_t size){
+    pthread_mutex_lock(&resultWatch.lock);
+    struct FollowedFile *file = getFollowedFile(name);
+    file->offset = size;
+    file->lineNumber = 0; // counted when the file changes, most files never do
+    pthread_mutex_unlock(&resultWatch.lock);
+}
+
+// This method searchs the complete lines a followed file got after its offset and prints their matches
+void searchFollowedFile(const char *name){
+    struct FollowedFile *file = getFollowedFile(name);
+    char filePath[PATH_MAX * 2];
+    snprintf(filePath, sizeof(filePath), "%s%s", searchOptions.rootDir, name);
+    int fd = open(filePath, O_RDONLY | O_CLOEXEC);
+    struct stat fileStat;
+    if (fd == -1 || fstat(fd, &fileStat) == -1 || !S_ISREG(fileStat.st_mode)) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    if (fileStat.st_size < file->offset) { // it is rewritten, search it again from the beginning
+        file->offset = 0;
+        file->lineNumber = 1;
+    }
+    if (fileStat.st_size == file->offset
+        || (searchOptions.maxFileSize > 0 && fileStat.st_size > searchOptions.maxFileSize)) {
+        close(fd);
+        return;
+    }
+    const char *mapped = (const char*)mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return;
+    }
+    if (file->lineNumber == 0) { // the first change, the search goes on from the last complete line
+        const char *lastNewline = (const char*)memrchr(mapped, '\n', file->offset);
+        file->offset = lastNewline ? lastNewline - mapped + 1 : 0;
+        file->lineNumber = (int)countNewlines(mapped, file->offset) + 1;
+    }
+    // a line that is still being written is searched when its newline comes
+    const char *start = mapped + file->offset;
+    const char *end = (const char*)memrchr(start, '\n', fileStat.st_size - file->offset);
+    if (end != NULL && (file->offset > 0 || (memchr(mapped, '\0', fileStat.st_size < BINARY_CHECK_SIZE ? fileStat.st_size : BINARY_CHECK_SIZE) == NULL
+                                             && isSearchedContent(&searchTypes, name, mapped, fileStat.st_size)))) {
+        end++;
+        struct SearchOutput out = {NULL, 0, 0};
+        searchInChunk(start, end - start, file->lineNumber, name, &out, NULL);
+        if (out.length > 0) {
+            fwrite(out.data, 1, out.length, stdout);
+            fflush(stdout);
+        }
+        free(out.data);
+        file->lineNumber += (int)countNewlines(start, end - start);
+        file->offset = end - mapped;
+    }
+    munmap((void*)mapped, fileStat.st_size);
+}
+
+// This method handles the inotify events of the followed tree
+void processFollowEvents(void){
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    while ((length = read(resultWatch.inotifyFd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + length; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            const struct inotify_event *event = (const struct inotify_event*)p;
+            if (event->mask & IN_IGNORED) { // the watch is removed by the kernel
+                if (event->wd < resultWatch.watchCapacity) {
+                    free(resultWatch.watchDirs[event->wd]);
+                    resultWatch.watchDirs[event->wd] = NULL;
+                    releaseIgnoreList(resultWatch.watchIgnores[event->wd]);
+                    resultWatch.watchIgnores[event->wd] = NULL;
+                }
+                continue;
+            }
+            if (event->len == 0 || event->wd >= resultWatch.watchCapacity || resultWatch.watchDirs[event->wd] == NULL) {
+                continue;
+            }
+            char name[PATH_MAX];
+            snprintf(name, sizeof(name), "%s/%s", resultWatch.watchDirs[event->wd], event->name);
+            struct IgnoreList *ignore = resultWatch.watchIgnores[event->wd];
+            if (event->mask & IN_ISDIR) {
+                if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && !isIgnoredPath(ignore, name + 1, event->name, 1)) { // a new directory, all of its files are new
+                    searchFollowedDirectory(event->wd, event->name);
+                }
+                continue;
+            }
+            if (!hasSearchExtension(&searchTypes, event->name) || isIgnoredPath(ignore, name + 1, event->name, 0)) {
+                continue;
+            }
+            if (event->mask & (IN_DELETE | IN_MOVED_FROM)) { // a file with this name later is new
+                struct FollowedFile *file = getFollowedFile(name);
+                file->offset = 0;
+                file->lineNumber = 1;
+            }
+            else {
+                if (event->mask & IN_CREATE) { // it may have an old entry from a file that is deleted
+                    struct FollowedFile *file = getFollowedFile(name);
+                    file->offset = 0;
+                    file->lineNumber = 1;
+                }
+                searchFollowedFile(name);
+            }
+        }
+    }
+}
+
+// This method sets up search -w before the first search, returns -1 if inotify is not available
+int startResultWatch(void){
+    resultWatch.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (resultWatch.inotifyFd == -1) {
+        fprintf(stderr, "Failed to start the watch: %s\n", strerror(errno));
+        return -1;
+    }
+    pthread_mutex_init(&resultWatch.lock, NULL);
+    return 0;
+}
+
+// This method prints the new matches until Enter is pressed, and then forgets the followed files
+void followSearchResults(void){
+    printf("Watching for new matches, press Enter to stop.\n");
+    fflush(stdout);
+    while (1) {
+        struct pollfd fds[2] = {{resultWatch.inotifyFd, POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents) { // the user wants the prompt back
+            char line[MAX_LINE];
+            ssize_t ignored = read(STDIN_FILENO, line, sizeof(line)); // the Enter is consumed, an end of input is seen again by setup
+            (void)ignored;
+            break;
+        }
+        if (fds[0].revents) {
+            processFollowEvents();
+        }
+    }
+    close(resultWatch.inotifyFd); // this also removes every watch
+    resultWatch.inotifyFd = -1;
+    for (size_t b = 0; b < resultWatch.numBuckets; b++) {
+        while (resultWatch.buckets[b] != NULL) {
+            struct FollowedFile *file = resultWatch.buckets[b];
+            resultWatch.buckets[b] = file->next;
+            free(file->name);
+            free(file);
+        }
+    }
+    free(resultWatch.buckets);
+    resultWatch.buckets = NULL;
+    resultWatch.numBuckets = 0;
+    resultWatch.numFiles = 0;
+    for (int wd = 0; wd < resultWatch.watchCapacity; wd++) {
+        free(resultWatch.watchDirs[wd]);
+        releaseIgnoreList(resultWatch.watchIgnores[wd]);
+    }
+    free(resultWatch.watchDirs);
+    free(resultWatch.watchIgnores);
+    resultWatch.watchDirs = NULL;
+    resultWatch.watchIgnores = NULL;
+    resultWatch.watchCapacity = 0;
+    pthread_mutex_destroy(&resultWatch.lock);
+}
+
+// This method adds a keyword to the search, the quotation marks are deleted if it has them
+void addKeyword(char *keyword){
+    if (keyword[0] == '"' && strlen(keyword) >= 2 && keyword[strlen(keyword) - 1] == '"') {
+        keyword = deleteQuotationMark(keyword);
+    }
+    searchOptions.keywords = (char**)realloc(searchOptions.keywords, (searchOptions.numKeywords + 1) * sizeof(char*));
+    searchOptions.keywords[searchOptions.numKeywords++] = keyword;
+}
+
+// setup splits the line at the blanks, so "two words" comes as two arguments.
+// This method joins them again and returns a new string from the command arena, i is moved to the last argument used.
+char *joinQuotedArgs(char **args, int *i){
+    const char *first = args[*i];
+    if (first[0] != '"' || (strlen(first) >= 2 && first[strlen(first) - 1] == '"')) {
+        return arenaStrdup(&commandArena, first); // not quoted, or closed in the same argument
+    }
+    int last = *i;
+    size_t length = strlen(first);
+    while (args[last + 1] != NULL) { // find the closing argument first, so the string is taken once
+        last++;
+        length += 1 + strlen(args[last]);
+        if (args[last][strlen(args[last]) - 1] == '"') {
+            break;
+        }
+    }
+    char *joined = (char*)arenaAlloc(&commandArena, length + 1);
+    size_t at = 0;
+    for (int a = *i; a <= last; a++) {
+        if (a > *i) {
+            joined[at++] = ' ';
+        }
+        size_t argLength = strlen(args[a]);
+        memcpy(joined + at, args[a], argLength);
+        at += argLength;
+    }
+    joined[at] = '\0';
+    *i = last;
+    return joined;
+}
+
+// This method reads the keywords of a keyword file, one keyword in every line, returns -1 if it can not be read
+int readKeywordFile(const char *filePath){
+    FILE *file = fopen(filePath, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening file: %s\n", filePath);
+        return -1;
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &capacity, file)) != -1) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            line[--length] = '\0';
+        }
+        if (length > 0) { // empty lines would match everything
+            addKeyword(arenaStrdup(&commandArena, line));
+        }
+    }
+    free(line);
+    fclose(file);
+    return 0;
+}
+
+// This method hashes everything that changes which lines match, the output format is not part of it
+uint64_t hashSearchSpec(void){
+    uint64_t hash = 14695981039346656037ULL;
+    const char *pattern = searchOptions.isRegex ? searchRegex.pattern : "";
+    for (int k = -1; k < searchOptions.numKeywords; k++) {
+        const char *text = k == -1 ? pattern : searchOptions.keywords[k];
+        do { // the NUL at the end is hashed too, so "ab" "c" and "a" "bc" are different
+            hash = (hash ^ (unsigned char)*text) * 1099511628211ULL;
+        } while (*text++ != '\0');
+    }
+    // -i changes which lines match, -l keeps only the first line of a file,
+    // and a file over --max-filesize is kept without lines
+    hash = (hash ^ (uint64_t)searchOptions.ignoreCase) * 1099511628211ULL;
+    hash = (hash ^ searchTypes.signature) * 1099511628211ULL; // a file without an extension depends on the types
+    hash = (hash ^ (uint64_t)searchOptions.listFiles) * 1099511628211ULL;
+    hash = (hash ^ (uint64_t)searchOptions.maxFileSize) * 1099511628211ULL;
+    return hash;
+}
+
+// This method reads the options of the search command:
+// search [-r] [-i] [-w] [-L] [-j N] [-t type] [--ext list] [-l | -c] [-m N] [--max-filesize size] [--max-depth N] [-f file | -e regex] [--null | --json] [--no-cache] [--sync-io] [--no-ignore] [--exclude glob] [--root path] [--files-from file] [--cache save|load|clear] [--index build|use|watch|unwatch] "keyword" ...
+// returns 0 on success, -1 if the command is not valid
+int parseSearchArgs(char **args){
+    searchOptions.keywords = NULL;
+    searchOptions.numKeywords = 0;
+    searchOptions.isRegex = 0;
+    searchOptions.format = SEARCH_FORMAT_TEXT;
+    searchOptions.useCache = 1;
+    searchOptions.useUring = 1;
+    searchOptions.useIgnoreFiles = 1;
+    searchOptions.excludes = NULL;
+    searchOptions.listFiles = 0;
+    searchOptions.countOnly = 0;
+    searchOptions.maxMatches = 0;
+    searchOptions.maxFileSize = 0;
+    searchOptions.maxDepth = -1;
+    searchOptions.followSymlinks = 0;
+    searchOptions.ignoreCase = 0;
+    searchOptions.watchResults = 0;
+    searchOptions.roots = NULL;
+    searchOptions.numRoots = 0;
+    searchOptions.filesFrom = NULL;
+    clearSearchTypes(&parsedTypes); // the types are chosen again, C files if none is given
+    searchOptions.recursive = 0;
+    searchOptions.mode = SEARCH_MODE_SCAN;
+    searchOptions.jobs = (int)sysconf(_SC_NPROCESSORS_ONLN); // by default use every core
+    if (searchOptions.jobs < 1) {
+        searchOptions.jobs = 1;
+    }
+
+    int i = 1;
+    while (args[i] != NULL && args[i][0] == '-') {
+        if (!strcmp(args[i], "-r")) { // if recursive
+            searchOptions.recursive = 1;
+        }
+        else if (!strcmp(args[i], "-j")) { // number of threads
+            if (args[i+1] == NULL || atoi(args[i+1]) < 1) {
+                fprintf(stderr, "You must enter a valid number.\n"); // check if int
+                return -1;
+            }
+            searchOptions.jobs = atoi(args[i+1]);
+            if (searchOptions.jobs > SEARCH_MAX_JOBS) {
+                searchOptions.jobs = SEARCH_MAX_JOBS;
+            }
+            i++;
+        }
+        else if (!strcmp(args[i], "-f")) { // keywords are in a file
+            if (args[i+1] == NULL || readKeywordFile(args[i+1]) == -1) {
+                fprintf(stderr, "Please enter a keyword file after -f.\n");
+                return -1;
+            }
+            i++;
+        }
+        else if (!strcmp(args[i], "--null")) { // output for tools
+            searchOptions.format = SEARCH_FORMAT_NULL;
+        }
+        else if (!strcmp(args[i], "--json")) {
+            searchOptions.format = SEARCH_FORMAT_JSON;
+        }
+        else if (!strcmp(args[i], "--no-cache")) { // read every file even if it did not change
+            searchOptions.useCache = 0;
+        }
+        else if (!strcmp(args[i], "-t") || !strcmp(args[i], "--ext")) { // a named type, or extensions like cpp,inl
+            if (args[i+1] == NULL) {
+                fprintf(stderr, "Please enter a %s after %s.\n", args[i][1] == 't' ? "type" : "list of extensions", args[i]);
+                return -1;
+            }
+            if (args[i][1] == 't' && addSearchType(&parsedTypes, args[i+1]) == -1) {
+                return -1;
+            }
+            if (args[i][1] != 't') {
+                addTypeItems(&parsedTypes, args[i+1], NULL, NULL);
+            }
+            i++;
+        }
+        else if (!strcmp(args[i], "--root") || !strcmp(args[i], "--files-from")) { // where to search
+            if (args[i+1] == NULL) {
+                fprintf(stderr, "Please enter a path after %s.\n", args[i]);
+                return -1;
+            }
+            int isRoot = !strcmp(args[i], "--root");
+            i++;
+            char *path = joinQuotedArgs(args, &i);
+            if (path[0] == '"' && strlen(path) >= 2 && path[strlen(path) - 1] == '"') {
+                path = deleteQuotationMark(path);
+            }
+            if (isRoot) {
+                searchOptions.roots = (char**)realloc(searchOptions.roots, (searchOptions.numRoots + 1) * sizeof(char*));
+                searchOptions.roots[searchOptions.numRoots++] = path;
+            }
+            else {
+                searchOptions.filesFrom = path;
+            }
+        }
+        else if (!strcmp(args[i], "-w")) { // keep watching after the search
+            searchOptions.watchResults = 1;
+        }
+        else if (!strcmp(args[i], "-i")) { // ignore the case of letters
+            searchOptions.ignoreCase = 1;
+        }
+        else if (!strcmp(args[i], "-L")) { // follow symbolic links
+            searchOptions.followSymlinks = 1;
+        }
+        else if (!strcmp(args[i], "-l")) { // list the matching files
+            searchOptions.listFiles = 1;
+        }
+        else if (!strcmp(args[i], "-c")) { // count the matching lines of every file
+            searchOptions.countOnly = 1;
+        }
+        else if (!strcmp(args[i], "-m") || !strcmp(args[i], "--max-depth")) { // a number after the option
+            char *end = NULL;
+            long value = args[i+1] != NULL ? strtol(args[i+1], &end, 10) : -1;
+            if (end == NULL || *end != '\0' || value < 1) { // no match or no level to search makes no sense
+                fprintf(stderr, "Please enter a number of at least 1 after %s.\n", args[i]);
+                return -1;
+            }
+            if (args[i][1] == 'm') {
+                searchOptions.maxMatches = value;
+            }
+            else {
+                searchOptions.maxDepth = (int)value;
+            }
+            i++;
+        }
+        else if (!strcmp(args[i], "--max-filesize")) { // a size like 500, 64K, 10M or 1G
+            char *end = NULL;
+            long long value = args[i+1] != NULL ? strtoll(args[i+1], &end, 10) : -1;
+            if (end != NULL && (*end == 'K' || *end == 'k')) {
+                value <<= 10;
+                end++;
+            }
+            else if (end != NULL && (*end == 'M' || *end == 'm')) {
+                value <<= 20;
+                end++;
+            }
+            else if (end != NULL && (*end == 'G' || *end == 'g')) {
+                value <<= 30;
+                end++;
+            }
+            if (end == NULL || *end != '\0' || value <= 0) {
+                fprintf(stderr, "Please enter a size after --max-filesize.\n");
+                return -1;
+            }
+            searchOptions.maxFileSize = (off_t)value;
+            i++;
+        }
+        else if (!strcmp(args[i], "--no-ignore")) { // search the ignored files too
+            searchOptions.useIgnoreFiles = 0;
+        }
+        else if (!strcmp(args[i], "--exclude")) { // leave the files and directories matching a glob out
+            if (args[i+1] == NULL) {
+                fprintf(stderr, "Please enter a glob after --exclude.\n");
+                return -1;
+            }
+            if (searchOptions.excludes == NULL) {
+                searchOptions.excludes = (struct IgnoreList*)calloc(1, sizeof(struct IgnoreList));
+                atomic_init(&searchOptions.excludes->refs, 1);
+            }
+            i++;
+            char *glob = joinQuotedArgs(args, &i);
+            if (glob[0] == '"' && strlen(glob) >= 2 && glob[strlen(glob) - 1] == '"') {
+                glob = deleteQuotationMark(glob);
+            }
+            addIgnorePattern(searchOptions.excludes, glob);
+        }
+        else if (!strcmp(args[i], "--sync-io")) { // do not use io_uring
+            searchOptions.useUring = 0;
+        }
+        else if (!strcmp(args[i], "--cache")) { // save, load or clear the result cache
+            if (args[i+1] != NULL && !strcmp(args[i+1], "save")) {
+                searchOptions.mode = SEARCH_MODE_SAVE_CACHE;
+            }
+            else if (args[i+1] != NULL && !strcmp(args[i+1], "load")) {
+                searchOptions.mode = SEARCH_MODE_LOAD_CACHE;
+            }
+            else if (args[i+1] != NULL && !strcmp(args[i+1], "clear")) {
+                searchOptions.mode = SEARCH_MODE_CLEAR_CACHE;
+            }
+            else {
+                fprintf(stderr, "Please enter save, load or clear after --cache.\n");
+                return -1;
+            }
+            i++;
+        }
+        else if (!strcmp(args[i], "-e")) { // a regular expression instead of keywords
+            if (args[i+1] == NULL) {
+                fprintf(stderr, "Please enter an expression after -e.\n");
+                return -1;
+            }
+            i++;
+            char *pattern = joinQuotedArgs(args, &i);
+            if (pattern[0] == '"' && strlen(pattern) >= 2 && pattern[strlen(pattern) - 1] == '"') {
+                pattern = deleteQuotationMark(pattern);
+            }
+            int result = compileRegex(&searchRegex, pattern);
+            if (result == -1) {
+                return -1;
+            }
+            searchOptions.isRegex = 1;
+        }
+        else if (!strcmp(args[i], "--index")) { // build or use the trigram index
+            if (args[i+1] != NULL && !strcmp(args[i+1], "build")) {
+                searchOptions.mode = SEARCH_MODE_BUILD_INDEX;
+            }
+            else if (args[i+1] != NULL && !strcmp(args[i+1], "use")) {
+                searchOptions.mode = SEARCH_MODE_USE_INDEX;
+            }
+            else if (args[i+1] != NULL && !strcmp(args[i+1], "watch")) {
+                searchOptions.mode = SEARCH_MODE_WATCH_INDEX;
+            }
+            else if (args[i+1] != NULL && !strcmp(args[i+1], "unwatch")) {
+                searchOptions.mode = SEARCH_MODE_UNWATCH_INDEX;
+            }
+            else {
+                fprintf(stderr, "Please enter build, use, watch or unwatch after --index.\n");
+                return -1;
+            }
+            i++;
+        }
+        else {
+            fprintf(stderr, "Unknown search option: %s\n", args[i]);
+            return -1;
+        }
+        i++;
+    }
+    for (; args[i] != NULL; i++) { // the rest are keywords
+        addKeyword(joinQuotedArgs(args, &i));
+    }
+    if (searchOptions.isRegex) {
+        if (searchOptions.ignoreCase) {
+            foldRegexCase(&searchRegex);
+        }
+        if (searchOptions.numKeywords > 0) {
+            fprintf(stderr, "Please give either keywords or -e, not both.\n");
+            return -1;
+        }
+        // the required literal is searched with the fast kernel (and the index), the DFA only checks its lines
+        addKeyword(arenaStrdup(&commandArena, searchRegex.literal));
+    }
+    if (searchOptions.numKeywords == 0 && (searchOptions.mode == SEARCH_MODE_SCAN || searchOptions.mode == SEARCH_MODE_USE_INDEX)) { // only searching needs a keyword
+        fprintf(stderr, "Usage: search [-r] [-i] [-w] [-L] [-j N] [-t type] [--ext list] [-l | -c] [-m N] [--max-filesize size] [--max-depth N] [-f file | -e regex] [--null | --json] [--no-cache] [--sync-io] [--no-ignore] [--exclude glob] [--root path] [--files-from file] [--cache save|load|clear] [--index build|use|watch|unwatch] \"keyword\" ...\n");
+        return -1;
+    }
+    if (searchOptions.numKeywords > 0) {
+        searchOptions.keywordLen = strlen(searchOptions.keywords[0]);
+    }
+    if (searchOptions.numKeywords > 1) { // several keywords are found together with one automaton
+        buildAutomaton(&searchAutomaton, searchOptions.keywords, searchOptions.numKeywords);
+    }
+    if (parsedTypes.numExtensions == 0 && parsedTypes.numInterpreters == 0 && parsedTypes.numMagics == 0) {
+        addSearchType(&parsedTypes, "c"); // search looks at C files by default
+    }
+    if (searchOptions.listFiles && searchOptions.countOnly) {
+        fprintf(stderr, "Please give either -l or -c, not both.\n");
+        return -1;
+    }
+    if (searchOptions.watchResults && (searchOptions.listFiles || searchOptions.countOnly || searchOptions.maxMatches > 0 || searchOptions.mode != SEARCH_MODE_SCAN)) {
+        fprintf(stderr, "-w prints every new matching line, it can not be used with -l, -c, -m or --index and --cache.\n");
+        return -1;
+    }
+    if ((searchOptions.numRoots > 0 || searchOptions.filesFrom != NULL) && searchOptions.mode != SEARCH_MODE_SCAN) {
+        fprintf(stderr, "--index and --cache work on the current directory, they can not be used with --root or --files-from.\n");
+        return -1;
+    }
+    if (searchOptions.watchResults && searchOptions.filesFrom != NULL) {
+        fprintf(stderr, "-w follows directories, it can not be used with --files-from.\n");
+        return -1;
+    }
+    if (searchOptions.maxMatches > 0) { // the cache would keep files that are searched only partly
+        searchOptions.useCache = 0;
+    }
+    atomic_store(&searchMatchesLeft, searchOptions.maxMatches);
+    atomic_store(&chunkThreadsLeft, searchOptions.jobs);
+    clearSearchTypes(&searchTypes); // the options are valid, only now their types replace the old ones
+    searchTypes = parsedTypes;
+    memset(&parsedTypes, 0, sizeof(parsedTypes));
+    searchOptions.specHash = hashSearchSpec();
+    return 0;
+}
+
+// This method frees the keywords of the last search
+void freeSearchKeywords(void){
+    free(searchOptions.keywords); // the keywords themselves are in the command arena
+    searchOptions.keywords = NULL;
+    searchOptions.numKeywords = 0;
+    searchOptions.isRegex = 0;
+    freeAutomaton(&searchAutomaton);
+    freeRegex(); // the DFA of this thread is made again for the next expression
+    releaseIgnoreList(searchOptions.excludes);
+    searchOptions.excludes = NULL;
+    free(searchOptions.roots);
+    searchOptions.roots = NULL;
+    searchOptions.numRoots = 0;
+    searchOptions.filesFrom = NULL;
+}
+
+// This method runs a search command, returns -1 if the shell can not go on
+int searchCommand(char **args){
+    if (parseSearchArgs(args) == -1) { // read the options and the keywords
+        freeSearchKeywords();
+        return 0;
+    }
+    // get the current directory using getcwd method
+    if (getcwd(searchOptions.rootDir, sizeof(searchOptions.rootDir)) == NULL) { 
+        fprintf(stderr, "Error getting current directory.\n"); // if fails
+        return -1;
+    }
+    searchOptions.rootLen = strlen(searchOptions.rootDir);
+    selectSearchKernels(); // pick the substring kernel for this cpu
+    if (searchOptions.mode == SEARCH_MODE_BUILD_INDEX) {
+        if (buildSearchIndex() == 0) { // write the index of the current directory
+            reloadIndexWatch(); // a watcher of this directory starts from the new index
+        }
+    }
+    else if (searchOptions.mode == SEARCH_MODE_WATCH_INDEX) {
+        startIndexWatch(); // keep the index of the current directory up to date
+    }
+    else if (searchOptions.mode == SEARCH_MODE_UNWATCH_INDEX) {
+        stopIndexWatch();
+    }
+    else if (searchOptions.mode == SEARCH_MODE_SAVE_CACHE) {
+        saveResultCache();
+    }
+    else if (searchOptions.mode == SEARCH_MODE_LOAD_CACHE) {
+        loadResultCache();
+    }
+    else if (searchOptions.mode == SEARCH_MODE_CLEAR_CACHE) {
+        clearResultCache();
+    }
+    else if (searchOptions.mode == SEARCH_MODE_USE_INDEX) {
+        searchWithIndex(); // only search the files the index gives
+    }
+    else if (searchOptions.watchResults) {
+        if (startResultWatch() == 0) {
+            searchFromRoots(); // the first search also adds the watches
+            followSearchResults(); // then the new matches are printed until Enter
+        }
+    }
+    else {
+        searchFromRoots(); // call the search function with the roots, the listed files or the current directory
+    }
+    freeSearchKeywords();
+    return 0;
+}
+
+// ***** PIPELINES *****
+// a | b | c starts every command with the output of the one before as its input, without sh -c.
+// The commands of a pipeline are in one process group and the shell waits for all of them. A tee
+// between two commands is done by the shell with tee and splice, so the data is not copied.
+
+#define MAX_PIPELINE_STAGES 16
+#define MAX_PIPELINE_GROUPS 64
+#define RELAY_CHUNK (64 * 1024)
+
+// a command of a pipeline
+struct PipelineStage {
+    char **args;
+    struct Redirect redirects[MAX_REDIRECTS + 2]; // the pipe ends first, then its own redirections
+    int numRedirects;
+    pid_t pid; // -1 if it could not be started
+};
+
+// process groups of the pipelines that run in the background, exit stops them too
+pid_t pipelineGroups[MAX_PIPELINE_GROUPS];
+int numPipelineGroups;
+
+// This method tells if an argument is a | of a pipeline. setup splits "a | b" at the blanks too, so
+// inQuotes keeps whether the arguments before opened a quotation that is not closed yet.
+int isPipeArg(const char *arg, int *inQuotes){
+    if (!*inQuotes && !strcmp(arg, "|")) {
+        return 1;
+    }
+    size_t len = strlen(arg);
+    if (!*inQuotes && arg[0] == '"') {
+        *inQuotes = len == 1 || arg[len - 1] != '"';
+    }
+    else if (*inQuotes && arg[len - 1] == '"') {
+        *inQuotes = 0;
+    }
+    return 0;
+}
+
+// This method tells if the command line has a |
+int isPipeline(char **args){
+    int inQuotes = 0;
+    for (int i = 0; args[i] != NULL; i++) {
+        if (isPipeArg(args[i], &inQuotes)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// This method tells if a stage is a command of the shell that can write into a pipe
+int isPipelineBuiltin(char **args){
+    return !strcmp(args[0], "search") || !strcmp(args[0], "hash") || !strcmp(args[0], "type")
+        || (!strcmp(args[0], "bookmark") && args[1] != NULL && !strcmp(args[1], "-l"));
+}
+
+// This method writes len bytes, the write may take them in parts
+int writeAll(int fd, const char *buffer, size_t len){
+    while (len > 0) {
+        ssize_t written = write(fd, buffer, len);
+        if (written <= 0) {
+            return -1;
+        }
+        buffer += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// This method is tee between two pipes. tee gives the next command a copy of what is in the input pipe
+// and splice moves the same bytes to the file, read and write are used where they can not be.
+void relayStage(int in, int out, int fileFd){
+    char buffer[RELAY_CHUNK];
+    int canSplice = 1;
+    while (1) {
+        ssize_t length = tee(in, out, RELAY_CHUNK, 0);
+        if (length == 0) { // the command before has finished
+            return;
+        }
+        if (length < 0) { // not two pipes
+            break;
+        }
+        while (length > 0 && canSplice) {
+            ssize_t moved = splice(in, NULL, fileFd, NULL, length, SPLICE_F_MOVE);
+            if (moved <= 0) {
+                canSplice = 0; // this file can not take spliced pages
+                break;
+            }
+            length -= moved;
+        }
+        while (length > 0) { // the rest of the copied bytes is read out of the pipe
+            ssize_t numRead = read(in, buffer, length < RELAY_CHUNK ? length : RELAY_CHUNK);
+            if (numRead <= 0 || writeAll(fileFd, buffer, numRead) == -1) {
+                return;
+            }
+            length -= numRead;
+        }
+    }
+    ssize_t numRead;
+    while ((numRead = read(in, buffer, sizeof(buffer))) > 0) {
+        if (writeAll(out, buffer, numRead) == -1 || writeAll(fileFd, buffer, numRead) == -1) {
+            return;
+        }
+    }
+}
+
+// This method starts a stage that runs code of the shell in a child, a builtin or the tee relay
+int forkShellStage(struct PipelineStage *stage, int relayFd, pid_t group, int (*pipes)[2], int numPipes, struct Bookmark *bookmarks){
+    fflush(stdout); // the child would write what is waiting again
+    stage->pid = fork();
+    if (stage->pid == -1) {
+        fprintf(stderr, "Failed to fork.\n");
+        return -1;
+    }
+    joinProcessGroup(stage->pid == 0 ? 0 : stage->pid, group);
+    if (stage->pid != 0) {
+        return 0;
+    }
+    signal(SIGTSTP, SIG_DFL); // the child stops like the other commands
+    for (int r = 0; r < stage->numRedirects; r++) {
+        dup2(stage->redirects[r].fd, stage->redirects[r].target);
+    }
+    for (int p = 0; p < numPipes; p++) { // no exec closes them, the next command would never see the end of its input
+        close(pipes[p][0]);
+        close(pipes[p][1]);
+    }
+    if (relayFd != -1) {
+        relayStage(STDIN_FILENO, STDOUT_FILENO, relayFd);
+    }
+    else if (!strcmp(stage->args[0], "search")) {
+        searchCommand(stage->args);
+    }
+    else if (!strcmp(stage->args[0], "hash")) {
+        hashCommands(stage->args);
+    }
+    else if (!strcmp(stage->args[0], "type")) {
+        typeCommands(stage->args);
+    }
+    else {
+        listBookmarks(bookmarks);
+    }
+    fflush(stdout);
+    _exit(0);
+}
+
+// This method runs a command line with |, returns -1 if it could not be started
+int runPipeline(char **args, int background, struct Bookmark *bookmarks){
+    struct PipelineStage stages[MAX_PIPELINE_STAGES];
+    int numStages = 0, start = 0, inQuotes = 0;
+    for (int i = 0; ; i++) { // split the arguments at every |
+        if (args[i] != NULL && !isPipeArg(args[i], &inQuotes)) {
+            continue;
+        }
+        if (i == start || numStages == MAX_PIPELINE_STAGES) {
+            fprintf(stderr, numStages == MAX_PIPELINE_STAGES ? "Too many commands in the pipeline.\n"
+                : "Please enter a command before and after |.\n");
+            return -1;
+        }
+        stages[numStages].args = &args[start];
+        stages[numStages++].numRedirects = 0;
+        if (args[i] == NULL) {
+            break;
+        }
+        args[i] = NULL;
+        start = i + 1;
+    }
+    for (int s = 0; s < numStages; s++) { // they change the shell itself, a child can not do it
+        char *name = stages[s].args[0];
+        if (!strcmp(name, "exit") || (!strcmp(name, "bookmark") && !isPipelineBuiltin(stages[s].args))) {
+            fprintf(stderr, "%s can not be used in a pipeline.\n", name);
+            return -1;
+        }
+    }
+    int pipes[MAX_PIPELINE_STAGES - 1][2];
+    int numPipes = 0, result = 0;
+    for (; numPipes < numStages - 1; numPipes++) {
+        if (pipe2(pipes[numPipes], O_CLOEXEC) == -1) { // a child only has the ends that are moved to 0 and 1
+            fprintf(stderr, "Failed to create a pipe.\n");
+            result = -1;
+            break;
+        }
+    }
+    // a background pipeline gets its own group, the first command makes it and the others join it.
+    // A foreground one stays in the group of the shell like a single command, so it can read the terminal and gets its signals.
+    pid_t group = background ? 0 : -1;
+    int numStarted = 0;
+    for (int s = 0; s < numStages && result == 0; s++) {
+        struct PipelineStage *stage = &stages[s];
+        if (s > 0) {
+            stage->redirects[stage->numRedirects].fd = pipes[s-1][0];
+            stage->redirects[stage->numRedirects++].target = STDIN_FILENO;
+        }
+        if (s < numStages - 1) {
+            stage->redirects[stage->numRedirects].fd = pipes[s][1];
+            stage->redirects[stage->numRedirects++].target = STDOUT_FILENO;
+        }
+        int numPipeEnds = stage->numRedirects;
+        stage->pid = -1;
+        int numFiles = 0;
+        if (collectRedirects(stage->args, stage->redirects + numPipeEnds, &numFiles) != 0) {
+            continue; // the other commands still run, this one gives nothing to the next
+        }
+        stage->numRedirects += numFiles;
+        char **stageArgs = stage->args;
+        if (stageArgs[0] == NULL) {
+            fprintf(stderr, "Please enter a command before and after |.\n");
+        }
+        else if (!strcmp(stageArgs[0], "tee") && stageArgs[1] != NULL && stageArgs[1][0] != '-' && stageArgs[2] == NULL
+            && s > 0 && s < numStages - 1 && stage->numRedirects == 2) { // between two pipes the shell does it
+            int fileFd = open(stageArgs[1], CREATE_FLAGS_TRUNC | O_CLOEXEC, 0777);
+            if (fileFd == -1) {
+                fprintf(stderr, "Failed to open file.\n");
+            }
+            else {
+                forkShellStage(stage, fileFd, group, pipes, numPipes, bookmarks);
+                close(fileFd);
+            }
+        }
+        else if (isPipelineBuiltin(stageArgs)) {
+            forkShellStage(stage, -1, group, pipes, numPipes, bookmarks);
+        }
+        else {
+            const char *commandPath = resolveCommand(stageArgs[0]);
+            if (commandPath == NULL) {
+                fprintf(stderr, "%s: command not found\n", stageArgs[0]);
+            }
+            else if (spawnCommand(commandPath, stageArgs, stage->redirects, stage->numRedirects, group) == 0) {
+                stage->pid = pid;
+            }
+        }
+        if (stage->pid > 0) {
+            numStarted++;
+            group = group == 0 ? stage->pid : group;
+        }
+        for (int r = numPipeEnds; r < stage->numRedirects; r++) { // the child has its files now
+            close(stage->redirects[r].fd);
+        }
+    }
+    for (int p = 0; p < numPipes; p++) { // the commands see the end of their input when only the writers hold it
+        close(pipes[p][0]);
+        close(pipes[p][1]);
+    }
+    if (numStarted == 0) {
+        return -1;
+    }
+    if (background) {
+        pipelineGroups[numPipelineGroups++ % MAX_PIPELINE_GROUPS] = group;
+        return result;
+    }
+    for (int s = 0; s < numStages; s++) { // wait for the whole pipeline
+        if (stages[s].pid > 0) {
+            waitpid(stages[s].pid, NULL, 0);
+        }
+    }
+    return result;
+}
+
+int main(void){
+   char inputBuffer[MAX_LINE]; /*buffer to hold command entered */
+    int background; /* equals 1 if a command is followed by '&' */
+    char *args[MAX_LINE/2 + 1]; /*command line arguments */
+    struct Bookmark* bookmarks = NULL; // bookmarks head
+    for (int s = 0; s < RESULT_CACHE_SHARDS; s++) { // locks of the search result cache
+        pthread_mutex_init(&resultCache[s].lock, NULL);
+    }
+    for (int s = 0; s < VISITED_SHARDS; s++) { // locks of the visited files of a search
+        pthread_mutex_init(&visitedFiles[s].lock, NULL);
+    }
+    initFoldTable(); // lower case table of search -i
+    clearSearchTypes(&searchTypes);
+    addSearchType(&searchTypes, "c"); // the types before the first search
+    searchOptions.types = &searchTypes;
+
+    while (1) {
+        processIndexEvents(); // apply the file changes to the watched search index, if there is one
+        printf("myshell: "); // print the my shell
+        fflush(stdout); // make sure that it is printed
+        resetArena(&commandArena); // nothing of the last command is used anymore
+        updatePathList(); // split PATH again only if it changed
+        background = 0; // background is 0 initally
+        /*setup() calls exit() when Control-D is entered */ 
+        setup(inputBuffer, args, &background, 0); // call setup function
+        if(background == 0) // adjust foreground
+            foreground = 1;
+        if(background == 1)
+            foreground = 0;
+
+
+        setupSignalHandler();
+
+        // *****PIPELINE*****
+        if(isPipeline(args)){
+            runPipeline(args, background, bookmarks); // every command of it is started here
+            continue;
+        }
+
+        // ********bookmark*********
+        if(!strcmp(args[0], "bookmark")){ // if it is a bookmark
             if(!strcmp(args[1], "-i")){ // check if the second argument is -i
                 int value = atoi(args[2]); // then make the value int
                 if(!value){
@@ -538,11 +5920,16 @@ int main(void){
                     }
                 }
                 struct Bookmark *neededBookmark = getBookmarkByIndex(bookmarks, value); // get the data
-                // TODO: execution will be added
-                char* command = deleteQuotationMark(neededBookmark->name); // delete quotataion marks
+                if (neededBookmark == NULL) {
+                    fprintf(stderr, "Index %d is out of bounds.\n", value);
+                    continue;
+                }
+                char* command = deleteQuotationMark(neededBookmark->name); // delete quotataion marks, the bookmark keeps its name
                 setup(command, args, &background, 1); // call setup to token them aga in
-                redirection(paths, number_of_paths, args, background); // call redirection if there is any
-                createProcess(paths, number_of_paths, args, background); // call createprocess if there is not any redirection
+                if (isPipeline(args))
+                    runPipeline(args, background, bookmarks);
+                else if (redirection(args, background) == 0) // call redirection if there is any
+                    createProcess(args, background, NULL, 0); // call createprocess if there is not any redirection
                 continue; // go back to the first state of while
             }
             else if (!strcmp(args[1], "-d")){  // check if the second argument is -i
@@ -564,16 +5951,19 @@ int main(void){
             }
             else if(*args[1] == '"') // if we insert one 
             {
-                char *command = args[1]; // get the command
-                int count = 2; // store the resulting "command" 
-                while(args[count] != NULL){
-                    char* result = (char*)malloc(strlen(args[count]) + strlen(command) + 2);
-                    strcpy(result, command);
-                    strcat(result, " ");
-                    strcat(result, args[count]);
-                    command = result;
-                    count++;
+                size_t length = 0;
+                for (int count = 1; args[count] != NULL; count++) { // store the resulting "command" 
+                    length += strlen(args[count]) + 1;
+                }
+                char *command = (char*)arenaAlloc(&commandArena, length); // it is copied into the bookmark pool
+                size_t at = 0;
+                for (int count = 1; args[count] != NULL; count++) {
+                    size_t argLength = strlen(args[count]);
+                    memcpy(command + at, args[count], argLength);
+                    at += argLength;
+                    command[at++] = ' ';
                 }
+                command[at - 1] = '\0';
                 insertBookmark(&bookmarks, command); // insert the bookmark
                 continue; // go back to the first state of while loop
             }
@@ -581,25 +5971,22 @@ int main(void){
 
         // *** SEARCH ***
         if(!strcmp(args[0], "search")){ // if the command is search
-            char currentDir[MAX_PATH_LEN]; // get the current directory using getcwd method
-            if (getcwd(currentDir, sizeof(currentDir)) == NULL) { 
-                fprintf(stderr, "Error getting current directory.\n"); // if fails
+            if (searchCommand(args) == -1) {
                 return EXIT_FAILURE;
             }
-            int recursive = 0;
-            if(!strcmp(args[1], "-r")){ // if recursive
-                recursive = 1;
-                args[1] = args[2];
-            }
-
-            int keywordLen = strlen(args[1]); // adjust the keyword and delete its quotation marks
-            char *keyword = (char*)malloc((keywordLen) * sizeof(char));
-            strcpy(keyword, args[1]);
-            char *keywordNoQuots = deleteQuotationMark(keyword);
-            searchInDirectory(currentDir, keywordNoQuots, recursive); // call the search function with the current directory
             continue; // go back to the first state of while loop 
         }
 
+        // *****HASH AND TYPE*****
+        if(!strcmp(args[0], "hash")){
+            hashCommands(args); // list, empty or fill the command table
+            continue;
+        }
+        if(!strcmp(args[0], "type")){
+            typeCommands(args); // tell what the names would run
+            continue;
+        }
+
         // *****EXIT*****
        if(!strcmp(args[0], "exit")){ // if exit is the command
             pid_t childpid; // store the child pid
@@ -619,6 +6006,9 @@ int main(void){
             }
             if(answer == 'y'){ // if exit is y
                 signal(SIGQUIT, SIG_IGN); // signal to quit and ignore the main is called
+                for (int g = 0; g < numPipelineGroups && g < MAX_PIPELINE_GROUPS; g++) {
+                    kill(-pipelineGroups[g], SIGQUIT); // background pipelines are in their own groups
+                }
                 if(kill(0, SIGQUIT) == 0){
                     printf("All background processes are terminated. System exits..\n"); // print these and exit
                     exit(0);
@@ -633,8 +6023,8 @@ int main(void){
             }
        }
         // if none of these happened it may be redirection we call it
-        if(redirection(paths, number_of_paths, args, background)==2)
-            continue; // if it was a redirection we returned 2 and go back to the first state of while loop
-        createProcess(paths, number_of_paths, args, background); // otherwise we directly call the create process
+        if(redirection(args, background)!=0)
+            continue; // if it was a redirection we returned 2, or 1 if it failed, and go back to the first state of while loop
+        createProcess(args, background, NULL, 0); // otherwise we directly call the create process
     }  
 }
\ No newline at end of file
@@ -0,0 +1,383 @@
+// searchBench.c
+// Benchmark of the search command of myshell. It writes a synthetic directory tree from a seed, so the
+// same options give the same tree on every machine, then runs search over it with a cold and a warm page
+// cache and prints files/s, MB/s and the p50/p99 time of the runs as JSON.
+//
+// gcc -Wall -O2 -o searchBench searchBench.c
+// ./searchBench --shell ./myshell --depth 3 --fanout 4 --files 20 --runs 10 > result.json
+//
+// Cold runs drop the pages of the tree with posix_fadvise before each run, so they need no root rights.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define BENCH_KEYWORD "benchneedle"
+#define MAX_PATH 4096
+
+// options of the benchmark
+struct BenchOptions {
+    char *shellPath; // the myshell binary that is measured
+    char *treeDir; // where the tree is written
+    char *searchArgs; // extra options given to search, like -j 4 or --sync-io
+    char *outPath; // the JSON is written here, stdout if NULL
+    unsigned long seed;
+    int depth; // levels of directories under the tree directory
+    int fanout; // directories in every directory
+    int filesPerDir;
+    long minSize; // sizes of the files are spread between these, more small files than big ones
+    long maxSize;
+    double matchDensity; // the part of the lines that have the keyword
+    int lineLength; // mean length of a line
+    int runs; // measured runs of each mode
+    int keepTree; // do not delete the tree at the end
+};
+
+struct BenchOptions benchOptions = {"./myshell", "/tmp/searchBenchTree", "", NULL, 1, 3, 4, 20, 512, 1 << 20, 0.01, 80, 10, 0};
+
+// what was written into the tree
+struct TreeStats {
+    long numFiles;
+    long numDirs;
+    long long numBytes;
+    long numMatches; // lines with the keyword
+    char **files; // paths of the files, cold runs drop their pages
+};
+
+struct TreeStats treeStats;
+
+unsigned long long randomState;
+
+// This method gives the next number of a xorshift generator, it is the same on every libc unlike rand
+unsigned long long nextRandom(void){
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 7;
+    randomState ^= randomState << 17;
+    return randomState;
+}
+
+// This method gives a number between 0 and 1
+double randomUnit(void){
+    return (nextRandom() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// This method gives a size between min and max, close to evenly on a log scale so most files are small.
+// One of the doublings min, 2min, 4min... is chosen evenly, then a size inside it.
+long randomSize(long minSize, long maxSize){
+    if (maxSize <= minSize) {
+        return minSize;
+    }
+    long base = minSize > 0 ? minSize : 1;
+    int numOctaves = 0;
+    for (long size = base; size < maxSize; size *= 2) {
+        numOctaves++;
+    }
+    double position = randomUnit() * numOctaves;
+    int octave = (int)position;
+    long low = base << octave;
+    long high = low * 2 < maxSize ? low * 2 : maxSize; // the last doubling stops at max
+    return low + (long)((high - low) * (position - octave));
+}
+
+// This method writes one file of lines, some of them with the keyword, returns -1 if it fails
+int writeBenchFile(const char *path){
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Error creating file: %s\n", path);
+        return -1;
+    }
+    long size = randomSize(benchOptions.minSize, benchOptions.maxSize), written = 0;
+    char line[4096];
+    while (written < size) {
+        // line lengths are between half and one and a half times the mean
+        int length = benchOptions.lineLength / 2 + (int)(nextRandom() % (unsigned long long)(benchOptions.lineLength + 1));
+        if (length >= (int)sizeof(line) - 1) {
+            length = sizeof(line) - 2;
+        }
+        if (length > size - written) {
+            length = size - written;
+        }
+        for (int c = 0; c < length; c++) {
+            line[c] = 'a' + nextRandom() % 26;
+            if (nextRandom() % 6 == 0) {
+                line[c] = ' ';
+            }
+        }
+        int keywordLength = strlen(BENCH_KEYWORD);
+        if (length > keywordLength && randomUnit() < benchOptions.matchDensity) { // put the keyword somewhere in it
+            int at = nextRandom() % (unsigned long long)(length - keywordLength);
+            memcpy(line + at, BENCH_KEYWORD, keywordLength);
+            treeStats.numMatches++;
+        }
+        line[length] = '\n';
+        fwrite(line, 1, length + 1, file);
+        written += length + 1;
+    }
+    fclose(file);
+    treeStats.files = (char**)realloc(treeStats.files, (treeStats.numFiles + 1) * sizeof(char*));
+    treeStats.files[treeStats.numFiles++] = strdup(path);
+    treeStats.numBytes += written;
+    return 0;
+}
+
+// This method writes the files and the directories of one level, returns -1 if it fails
+int writeBenchTree(const char *dirPath, int level){
+    if (mkdir(dirPath, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Error creating directory: %s\n", dirPath);
+        return -1;
+    }
+    treeStats.numDirs++;
+    char path[MAX_PATH];
+    for (int f = 0; f < benchOptions.filesPerDir; f++) {
+        snprintf(path, sizeof(path), "%s/f%d.c", dirPath, f);
+        if (writeBenchFile(path) == -1) {
+            return -1;
+        }
+    }
+    if (level == benchOptions.depth) {
+        return 0;
+    }
+    for (int d = 0; d < benchOptions.fanout; d++) {
+        snprintf(path, sizeof(path), "%s/d%d", dirPath, d);
+        if (writeBenchTree(path, level + 1) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// This method deletes the tree with rm, it is only a benchmark directory
+void removeBenchTree(void){
+    pid_t childpid = fork();
+    if (childpid == 0) {
+        execlp("rm", "rm", "-rf", benchOptions.treeDir, (char*)NULL);
+        _exit(127);
+    }
+    if (childpid > 0) {
+        waitpid(childpid, NULL, 0);
+    }
+}
+
+// This method drops the cached pages of every file in the tree
+void dropTreePages(void){
+    for (long f = 0; f < treeStats.numFiles; f++) {
+        int fd = open(treeStats.files[f], O_RDONLY);
+        if (fd == -1) {
+            continue;
+        }
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+// This method gives the time in seconds
+double nowSeconds(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// This method runs the shell in the tree with one command and gives the seconds until it exits, -1 if it fails
+double runShell(const char *command){
+    int commandPipe[2];
+    if (pipe(commandPipe) == -1) {
+        fprintf(stderr, "Error creating pipe.\n");
+        return -1;
+    }
+    double start = nowSeconds();
+    pid_t childpid = fork();
+    if (childpid == -1) {
+        fprintf(stderr, "Error forking.\n");
+        return -1;
+    }
+    if (childpid == 0) {
+        int nullFd = open("/dev/null", O_WRONLY);
+        dup2(commandPipe[0], STDIN_FILENO);
+        dup2(nullFd, STDOUT_FILENO); // the matches are not part of what is measured
+        close(commandPipe[0]);
+        close(commandPipe[1]);
+        close(nullFd);
+        if (chdir(benchOptions.treeDir) == -1) {
+            _exit(127);
+        }
+        execl(benchOptions.shellPath, benchOptions.shellPath, (char*)NULL);
+        _exit(127);
+    }
+    close(commandPipe[0]);
+    // the shell runs the command, then the end of its input makes it exit
+    if (write(commandPipe[1], command, strlen(command)) == -1) {
+        fprintf(stderr, "Error writing to the shell.\n");
+    }
+    close(commandPipe[1]);
+    int status;
+    waitpid(childpid, &status, 0);
+    double seconds = nowSeconds() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+        fprintf(stderr, "Error running %s\n", benchOptions.shellPath);
+        return -1;
+    }
+    return seconds;
+}
+
+// This method is for qsort
+int compareSeconds(const void *a, const void *b){
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// This method gives the value at a percent of the sorted times
+double percentile(double *sorted, int count, double percent){
+    int at = (int)(percent / 100.0 * count + 0.5) - 1;
+    if (at < 0) {
+        at = 0;
+    }
+    if (at >= count) {
+        at = count - 1;
+    }
+    return sorted[at];
+}
+
+// This method measures one mode and writes its JSON object, returns -1 if a run fails
+int runBenchMode(FILE *out, const char *mode, int isCold, const char *command, double startup){
+    double *times = (double*)malloc(benchOptions.runs * sizeof(double));
+    if (!isCold && runShell(command) == -1) { // this run only fills the page cache
+        free(times);
+        return -1;
+    }
+    for (int r = 0; r < benchOptions.runs; r++) {
+        if (isCold) {
+            dropTreePages();
+        }
+        times[r] = runShell(command);
+        if (times[r] == -1) {
+            free(times);
+            return -1;
+        }
+        times[r] -= startup; // only the search is measured
+        if (times[r] < 1e-6) {
+            times[r] = 1e-6;
+        }
+    }
+    qsort(times, benchOptions.runs, sizeof(double), compareSeconds);
+    double p50 = percentile(times, benchOptions.runs, 50), p99 = percentile(times, benchOptions.runs, 99);
+    fprintf(out, "    \"%s\": {\"runs\": %d, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"min_ms\": %.3f, \"max_ms\": %.3f, "
+        "\"files_per_s\": %.1f, \"mb_per_s\": %.2f}", mode, benchOptions.runs, p50 * 1e3, p99 * 1e3, times[0] * 1e3,
+        times[benchOptions.runs - 1] * 1e3, treeStats.numFiles / p50, treeStats.numBytes / 1048576.0 / p50);
+    free(times);
+    return 0;
+}
+
+// This method writes a string as a JSON string
+void printJsonString(FILE *out, const char *text){
+    fputc('"', out);
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') {
+            fputc('\\', out);
+        }
+        fputc(*text, out);
+    }
+    fputc('"', out);
+}
+
+// This method reads the options, returns -1 if one of them is wrong
+int parseBenchArgs(int argc, char **argv){
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--keep")) {
+            benchOptions.keepTree = 1;
+            continue;
+        }
+        if (i + 1 == argc) {
+            fprintf(stderr, "Please enter a value after %s.\n", argv[i]);
+            return -1;
+        }
+        char *value = argv[++i];
+        if (!strcmp(argv[i-1], "--shell")) benchOptions.shellPath = value;
+        else if (!strcmp(argv[i-1], "--dir")) benchOptions.treeDir = value;
+        else if (!strcmp(argv[i-1], "--search-args")) benchOptions.searchArgs = value;
+        else if (!strcmp(argv[i-1], "--out")) benchOptions.outPath = value;
+        else if (!strcmp(argv[i-1], "--seed")) benchOptions.seed = strtoul(value, NULL, 10);
+        else if (!strcmp(argv[i-1], "--depth")) benchOptions.depth = atoi(value);
+        else if (!strcmp(argv[i-1], "--fanout")) benchOptions.fanout = atoi(value);
+        else if (!strcmp(argv[i-1], "--files")) benchOptions.filesPerDir = atoi(value);
+        else if (!strcmp(argv[i-1], "--min-size")) benchOptions.minSize = atol(value);
+        else if (!strcmp(argv[i-1], "--max-size")) benchOptions.maxSize = atol(value);
+        else if (!strcmp(argv[i-1], "--density")) benchOptions.matchDensity = atof(value);
+        else if (!strcmp(argv[i-1], "--line-length")) benchOptions.lineLength = atoi(value);
+        else if (!strcmp(argv[i-1], "--runs")) benchOptions.runs = atoi(value);
+        else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i-1]);
+            return -1;
+        }
+    }
+    if (benchOptions.depth < 0 || benchOptions.fanout < 0 || benchOptions.filesPerDir < 0 || benchOptions.runs < 1
+        || benchOptions.minSize < 1 || benchOptions.maxSize < benchOptions.minSize || benchOptions.lineLength < 1) {
+        fprintf(stderr, "Usage: searchBench [--shell path] [--dir path] [--search-args \"options\"] [--out file] [--seed N] "
+            "[--depth N] [--fanout N] [--files N] [--min-size bytes] [--max-size bytes] [--density 0..1] "
+            "[--line-length N] [--runs N] [--keep]\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv){
+    if (parseBenchArgs(argc, argv) == -1) {
+        return EXIT_FAILURE;
+    }
+    char shellPath[MAX_PATH];
+    if (realpath(benchOptions.shellPath, shellPath) == NULL) { // the shell is started in the tree directory
+        fprintf(stderr, "Error finding the shell: %s\n", benchOptions.shellPath);
+        return EXIT_FAILURE;
+    }
+    benchOptions.shellPath = shellPath;
+    randomState = benchOptions.seed * 2654435761ULL + 88172645463325252ULL; // xorshift can not start from 0
+    removeBenchTree(); // a tree of other options may be there
+    if (writeBenchTree(benchOptions.treeDir, 0) == -1) {
+        return EXIT_FAILURE;
+    }
+    char search[MAX_PATH], command[MAX_PATH + 1];
+    snprintf(search, sizeof(search), "search --no-cache %s %s", benchOptions.searchArgs, BENCH_KEYWORD);
+    snprintf(command, sizeof(command), "%s\n", search);
+    double startup = runShell(""); // the shell with no command, this time is not the search
+    if (startup == -1) {
+        return EXIT_FAILURE;
+    }
+    FILE *out = benchOptions.outPath ? fopen(benchOptions.outPath, "w") : stdout;
+    if (out == NULL) {
+        fprintf(stderr, "Error creating file: %s\n", benchOptions.outPath);
+        return EXIT_FAILURE;
+    }
+    fprintf(out, "{\n  \"timestamp\": %ld,\n  \"command\": ", (long)time(NULL));
+    printJsonString(out, search);
+    fprintf(out, ",\n  \"tree\": {\"seed\": %lu, \"depth\": %d, \"fanout\": %d, \"files_per_dir\": %d, \"min_size\": %ld, "
+        "\"max_size\": %ld, \"density\": %g, \"line_length\": %d, \"files\": %ld, \"dirs\": %ld, \"bytes\": %lld, \"matches\": %ld},\n",
+        benchOptions.seed, benchOptions.depth, benchOptions.fanout, benchOptions.filesPerDir, benchOptions.minSize,
+        benchOptions.maxSize, benchOptions.matchDensity, benchOptions.lineLength, treeStats.numFiles, treeStats.numDirs,
+        treeStats.numBytes, treeStats.numMatches);
+    fprintf(out, "  \"startup_ms\": %.3f,\n  \"modes\": {\n", startup * 1e3);
+    int result = runBenchMode(out, "cold", 1, command, startup);
+    if (result == 0) {
+        fprintf(out, ",\n");
+        result = runBenchMode(out, "warm", 0, command, startup);
+    }
+    fprintf(out, "\n  }\n}\n");
+    if (out != stdout) {
+        fclose(out);
+    }
+    if (!benchOptions.keepTree) {
+        removeBenchTree();
+    }
+    for (long f = 0; f < treeStats.numFiles; f++) {
+        free(treeStats.files[f]);
+    }
+    free(treeStats.files);
+    return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}